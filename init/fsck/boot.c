@@ -75,56 +75,77 @@ static char *get_media_descr(unsigned char media)
     return ("undefined");
 }
 
+/**
+ * Find where the undo journal header goes: the last reserved sector of a
+ * FAT32 volume, which the boot sectors and their backups leave unused.
+ * Unlike the FSINFO sector, it is not in the block of almost every flush, so
+ * the header cannot be torn by a flush it is meant to roll back.
+ *
+ * @param[in]   b       Boot sector of a FAT32 volume
+ *
+ * @return      Byte offset of the header, 0 if there is no room for it
+ */
+static loff_t journal_sector(const struct boot_sector *b)
+{
+    unsigned last = le16toh(b->reserved) - 1;
+
+    /* Sector 2 and the two after the backup boot sector hold boot code */
+    if (!le16toh(b->reserved) || last <= 2 ||
+	last <= le16toh(b->info_sector) || last <= le16toh(b->backup_boot) + 2)
+	return 0;
+    return (loff_t) last * GET_UNALIGNED_W(b->sector_size);
+}
+
 static void dump_boot(DOS_FS * fs, struct boot_sector *b, unsigned lss)
 {
     unsigned short sectors;
 
-    printf("Boot sector contents:\n");
+    report("Boot sector contents:\n");
     if (!atari_format) {
 	char id[9];
 	strncpy(id, (const char *)b->system_id, 8);
 	id[8] = 0;
-	printf("System ID \"%s\"\n", id);
+	report("System ID \"%s\"\n", id);
     } else {
 	/* On Atari, a 24 bit serial number is stored at offset 8 of the boot
 	 * sector */
-	printf("Serial number 0x%x\n",
+	report("Serial number 0x%x\n",
 	       b->system_id[5] | (b->system_id[6] << 8) | (b->
 							   system_id[7] << 16));
     }
-    printf("Media byte 0x%02x (%s)\n", b->media, get_media_descr(b->media));
-    printf("%10d bytes per logical sector\n", GET_UNALIGNED_W(b->sector_size));
-    printf("%10d bytes per cluster\n", fs->cluster_size);
-    printf("%10d reserved sector%s\n", le16toh(b->reserved),
+    report("Media byte 0x%02x (%s)\n", b->media, get_media_descr(b->media));
+    report("%10d bytes per logical sector\n", GET_UNALIGNED_W(b->sector_size));
+    report("%10d bytes per cluster\n", fs->cluster_size);
+    report("%10d reserved sector%s\n", le16toh(b->reserved),
 	   le16toh(b->reserved) == 1 ? "" : "s");
-    printf("First FAT starts at byte %llu (sector %llu)\n",
+    report("First FAT starts at byte %llu (sector %llu)\n",
 	   (unsigned long long)fs->fat_start,
 	   (unsigned long long)fs->fat_start / lss);
-    printf("%10d FATs, %d bit entries\n", b->fats, fs->fat_bits);
-    printf("%10d bytes per FAT (= %u sectors)\n", fs->fat_size,
+    report("%10d FATs, %d bit entries\n", b->fats, fs->fat_bits);
+    report("%10d bytes per FAT (= %u sectors)\n", fs->fat_size,
 	   fs->fat_size / lss);
     if (!fs->root_cluster) {
-	printf("Root directory starts at byte %llu (sector %llu)\n",
+	report("Root directory starts at byte %llu (sector %llu)\n",
 	       (unsigned long long)fs->root_start,
 	       (unsigned long long)fs->root_start / lss);
-	printf("%10d root directory entries\n", fs->root_entries);
+	report("%10d root directory entries\n", fs->root_entries);
     } else {
-	printf("Root directory start at cluster %lu (arbitrary size)\n",
+	report("Root directory start at cluster %lu (arbitrary size)\n",
 	       (unsigned long)fs->root_cluster);
     }
-    printf("Data area starts at byte %llu (sector %llu)\n",
+    report("Data area starts at byte %llu (sector %llu)\n",
 	   (unsigned long long)fs->data_start,
 	   (unsigned long long)fs->data_start / lss);
-    printf("%10lu data clusters (%llu bytes)\n", (unsigned long)fs->clusters,
+    report("%10lu data clusters (%llu bytes)\n", (unsigned long)fs->clusters,
 	   (unsigned long long)fs->clusters * fs->cluster_size);
-    printf("%u sectors/track, %u heads\n", le16toh(b->secs_track),
+    report("%u sectors/track, %u heads\n", le16toh(b->secs_track),
 	   le16toh(b->heads));
-    printf("%10u hidden sectors\n", atari_format ?
+    report("%10u hidden sectors\n", atari_format ?
 	   /* On Atari, the hidden field is only 16 bit wide and unused */
 	   (((unsigned char *)&b->hidden)[0] |
 	    ((unsigned char *)&b->hidden)[1] << 8) : le32toh(b->hidden));
     sectors = GET_UNALIGNED_W(b->sectors);
-    printf("%10u sectors total\n", sectors ? sectors : le32toh(b->total_sect));
+    report("%10u sectors total\n", sectors ? sectors : le32toh(b->total_sect));
 }
 
 static void check_backup_boot(DOS_FS * fs, struct boot_sector *b, int lss)
@@ -132,15 +153,15 @@ static void check_backup_boot(DOS_FS * fs, struct boot_sector *b, int lss)
     struct boot_sector b2;
 
     if (!fs->backupboot_start) {
-	printf("There is no backup boot sector.\n");
+	report("There is no backup boot sector.\n");
 	if (le16toh(b->reserved) < 3) {
-	    printf("And there is no space for creating one!\n");
+	    report("And there is no space for creating one!\n");
 	    return;
 	}
 	if (interactive)
-	    printf("1) Create one\n2) Do without a backup\n");
+	    report("1) Create one\n2) Do without a backup\n");
 	else
-	    printf("  Auto-creating backup boot block.\n");
+	    report("  Auto-creating backup boot block.\n");
 	if (!interactive || get_key("12", "?") == '1') {
 	    int bbs;
 	    /* The usual place for the backup boot sector is sector 6. Choose
@@ -157,7 +178,7 @@ static void check_backup_boot(DOS_FS * fs, struct boot_sector *b, int lss)
 	    fs_write(fs->backupboot_start, sizeof(*b), b);
 	    fs_write((loff_t) offsetof(struct boot_sector, backup_boot),
 		     sizeof(b->backup_boot), &b->backup_boot);
-	    printf("Created backup of boot sector in sector %d\n", bbs);
+	    report("Created backup of boot sector in sector %d\n", bbs);
 	    return;
 	} else
 	    return;
@@ -170,8 +191,8 @@ static void check_backup_boot(DOS_FS * fs, struct boot_sector *b, int lss)
 	int i, pos, first = 1;
 	char buf[20];
 
-	printf("There are differences between boot sector and its backup.\n");
-	printf("This is mostly harmless. Differences: (offset:original/backup)\n  ");
+	report("There are differences between boot sector and its backup.\n");
+	report("This is mostly harmless. Differences: (offset:original/backup)\n  ");
 	pos = 2;
 	for (p = (__u8 *) b, q = (__u8 *) & b2, i = 0; i < sizeof(b2);
 	     ++p, ++q, ++i) {
@@ -179,19 +200,19 @@ static void check_backup_boot(DOS_FS * fs, struct boot_sector *b, int lss)
 		sprintf(buf, "%s%u:%02x/%02x", first ? "" : ", ",
 			(unsigned)(p - (__u8 *) b), *p, *q);
 		if (pos + strlen(buf) > 78)
-		    printf("\n  "), pos = 2;
-		printf("%s", buf);
+		    report("\n  "), pos = 2;
+		report("%s", buf);
 		pos += strlen(buf);
 		first = 0;
 	    }
 	}
-	printf("\n");
+	report("\n");
 
 	if (interactive)
-	    printf("1) Copy original to backup\n"
+	    report("1) Copy original to backup\n"
 		   "2) Copy backup to original\n" "3) No action\n");
 	else
-	    printf("  Not automatically fixing this.\n");
+	    report("  Not automatically fixing this.\n");
 	switch (interactive ? get_key("123", "?") : '3') {
 	case '1':
 	    fs_write(fs->backupboot_start, sizeof(*b), b);
@@ -219,11 +240,11 @@ static void read_fsinfo(DOS_FS * fs, struct boot_sector *b, int lss)
     struct info_sector i;
 
     if (!b->info_sector) {
-	printf("No FSINFO sector\n");
+	report("No FSINFO sector\n");
 	if (interactive)
-	    printf("1) Create one\n2) Do without FSINFO\n");
+	    report("1) Create one\n2) Do without FSINFO\n");
 	else
-	    printf("  Not automatically creating it.\n");
+	    report("  Not automatically creating it.\n");
 	if (interactive && get_key("12", "?") == '1') {
 	    /* search for a free reserved sector (not boot sector and not
 	     * backup boot sector) */
@@ -242,7 +263,7 @@ static void read_fsinfo(DOS_FS * fs, struct boot_sector *b, int lss)
 			     offsetof(struct boot_sector, info_sector),
 			     sizeof(b->info_sector), &b->info_sector);
 	    } else {
-		printf("No free reserved sector found -- "
+		report("No free reserved sector found -- "
 		       "no space for FSINFO sector!\n");
 		return;
 	    }
@@ -255,23 +276,23 @@ static void read_fsinfo(DOS_FS * fs, struct boot_sector *b, int lss)
 
     if (i.magic != htole32(0x41615252) ||
 	i.signature != htole32(0x61417272) || i.boot_sign != htole16(0xaa55)) {
-	printf("FSINFO sector has bad magic number(s):\n");
+	report("FSINFO sector has bad magic number(s):\n");
 	if (i.magic != htole32(0x41615252))
-	    printf("  Offset %llu: 0x%08x != expected 0x%08x\n",
+	    report("  Offset %llu: 0x%08x != expected 0x%08x\n",
 		   (unsigned long long)offsetof(struct info_sector, magic),
 		   le32toh(i.magic), 0x41615252);
 	if (i.signature != htole32(0x61417272))
-	    printf("  Offset %llu: 0x%08x != expected 0x%08x\n",
+	    report("  Offset %llu: 0x%08x != expected 0x%08x\n",
 		   (unsigned long long)offsetof(struct info_sector, signature),
 		   le32toh(i.signature), 0x61417272);
 	if (i.boot_sign != htole16(0xaa55))
-	    printf("  Offset %llu: 0x%04x != expected 0x%04x\n",
+	    report("  Offset %llu: 0x%04x != expected 0x%04x\n",
 		   (unsigned long long)offsetof(struct info_sector, boot_sign),
 		   le16toh(i.boot_sign), 0xaa55);
 	if (interactive)
-	    printf("1) Correct\n2) Don't correct (FSINFO invalid then)\n");
+	    report("1) Correct\n2) Don't correct (FSINFO invalid then)\n");
 	else
-	    printf("  Auto-correcting it.\n");
+	    report("  Auto-correcting it.\n");
 	if (!interactive || get_key("12", "?") == '1') {
 	    init_fsinfo(&i);
 	    fs_write(fs->fsinfo_start, sizeof(i), &i);
@@ -285,14 +306,14 @@ static void read_fsinfo(DOS_FS * fs, struct boot_sector *b, int lss)
 
 static char print_fat_dirty_state(void)
 {
-    printf("Dirty bit is set. Fs was not properly unmounted and"
+    report("Dirty bit is set. Fs was not properly unmounted and"
 	   " some data may be corrupt.\n");
 
     if (interactive) {
-	printf("1) Remove dirty bit\n" "2) No action\n");
+	report("1) Remove dirty bit\n" "2) No action\n");
 	return get_key("12", "?");
     } else
-	printf(" Automatically removing dirty bit.\n");
+	report(" Automatically removing dirty bit.\n");
     return '1';
 }
 
@@ -302,7 +323,8 @@ static void check_fat_state_bit(DOS_FS * fs, void *b)
 	struct boot_sector *b32 = b;
 
 	if (b32->reserved3 & FAT_STATE_DIRTY) {
-	    printf("0x41: ");
+	    fs->was_dirty = 1;
+	    report("0x41: ");
 	    if (print_fat_dirty_state() == '1') {
 		b32->reserved3 &= ~FAT_STATE_DIRTY;
 		fs_write(0, sizeof(*b32), b32);
@@ -312,7 +334,8 @@ static void check_fat_state_bit(DOS_FS * fs, void *b)
 	struct boot_sector_16 *b16 = b;
 
 	if (b16->reserved2 & FAT_STATE_DIRTY) {
-	    printf("0x25: ");
+	    fs->was_dirty = 1;
+	    report("0x25: ");
 	    if (print_fat_dirty_state() == '1') {
 		b16->reserved2 &= ~FAT_STATE_DIRTY;
 		fs_write(0, sizeof(*b16), b16);
@@ -326,8 +349,9 @@ void read_boot(DOS_FS * fs)
     struct boot_sector b;
     unsigned total_sectors;
     unsigned short logical_sector_size, sectors;
-    unsigned fat_length;
+    unsigned fat_length, i;
     loff_t data_size;
+    char *sector;
 
     fs_read(0, sizeof(b), &b);
     logical_sector_size = GET_UNALIGNED_W(b.sector_size);
@@ -350,7 +374,7 @@ void read_boot(DOS_FS * fs)
     sectors = GET_UNALIGNED_W(b.sectors);
     total_sectors = sectors ? sectors : le32toh(b.total_sect);
     if (verbose)
-	printf("Checking we can access the last sector of the filesystem\n");
+	report("Checking we can access the last sector of the filesystem\n");
     /* Can't access last odd sector anyway, so round down */
     fs_test((loff_t) ((total_sectors & ~1) - 1) * (loff_t) logical_sector_size,
 	    logical_sector_size);
@@ -367,6 +391,9 @@ void read_boot(DOS_FS * fs)
     fs->clusters = data_size / fs->cluster_size;
     fs->root_cluster = 0;	/* indicates standard, pre-FAT32 root dir */
     fs->fsinfo_start = 0;	/* no FSINFO structure */
+    fs->stamp_start = 0;
+    fs->journal_start = 0;
+    fs->was_dirty = 0;
     fs->free_clusters = -1;	/* unknown */
     if (!b.fat_length && b.fat32_length) {
 	fs->fat_bits = 32;
@@ -377,16 +404,16 @@ void read_boot(DOS_FS * fs)
 	     * (root_entries != 0), we handle the root dir the old way. Give a
 	     * warning, but convertig to a root dir in a cluster chain seems
 	     * to complex for now... */
-	    printf("Warning: FAT32 root dir not in cluster chain! "
+	    report("Warning: FAT32 root dir not in cluster chain! "
 		   "Compatibility mode...\n");
 	else if (!fs->root_cluster && !fs->root_entries)
 	    die("No root directory!");
 	else if (fs->root_cluster && fs->root_entries)
-	    printf("Warning: FAT32 root dir is in a cluster chain, but "
+	    report("Warning: FAT32 root dir is in a cluster chain, but "
 		   "a separate root dir\n"
 		   "  area is defined. Cannot fix this easily.\n");
 	if (fs->clusters < FAT16_THRESHOLD)
-	    printf("Warning: Filesystem is FAT32 according to fat_length "
+	    report("Warning: Filesystem is FAT32 according to fat_length "
 		   "and fat32_length fields,\n"
 		   "  but has only %lu clusters, less than the required "
 		   "minimum of %d.\n"
@@ -398,6 +425,20 @@ void read_boot(DOS_FS * fs)
 	check_backup_boot(fs, &b, logical_sector_size);
 
 	read_fsinfo(fs, &b, logical_sector_size);
+	if (fs->fsinfo_start) {
+	    fs->stamp_start = fs->fsinfo_start +
+		offsetof(struct info_sector, junk);
+	    /* Only a sector nothing else uses; replay_journal has cleared
+	     * the header of our own last flush by now */
+	    if ((fs->journal_start = journal_sector(&b))) {
+		sector = talloc(logical_sector_size);
+		fs_read(fs->journal_start, logical_sector_size, sector);
+		for (i = 0; i < logical_sector_size && !sector[i]; i++) ;
+		if (i < logical_sector_size)
+		    fs->journal_start = 0;
+		tfree(sector);
+	    }
+	}
     } else if (!atari_format) {
 	/* On real MS-DOS, a 16 bit FAT is used whenever there would be too
 	 * much clusers otherwise. */
@@ -457,6 +498,9 @@ void read_boot(DOS_FS * fs)
     if (!atari_format && (!b.secs_track || !b.heads))
 	die("Invalid disk format in boot sector.");
 #endif
+    /* Like the kernel, only keep the second FAT in sync with the first */
+    if (fs->nfats > 1)
+	fs_mirror(fs->fat_start, fs->fat_size, fs->fat_start + fs->fat_size);
     if (verbose)
 	dump_boot(fs, &b, logical_sector_size);
 }
@@ -524,7 +568,7 @@ loff_t find_volume_de(DOS_FS * fs, DIR_ENT * de)
 static void write_volume_label(DOS_FS * fs, char *label)
 {
     time_t now = time(NULL);
-    struct tm *mtime = localtime(&now);
+    struct tm tm_buf, *mtime = localtime_r(&now, &tm_buf);
     loff_t offset;
     int created;
     DIR_ENT de;
@@ -566,3 +610,128 @@ void write_label(DOS_FS * fs, char *label)
     write_boot_label(fs, label);
     write_volume_label(fs, label);
 }
+
+void set_dirty_bit(void)
+{
+    struct boot_sector b;
+    struct boot_sector_16 *b16 = (struct boot_sector_16 *)&b;
+
+    fs_read(0, sizeof(b), &b);
+    if (!b.fat_length && b.fat32_length) {
+	b.reserved3 |= FAT_STATE_DIRTY;
+	fs_write(offsetof(struct boot_sector, reserved3), 1, &b.reserved3);
+    } else {
+	b16->reserved2 |= FAT_STATE_DIRTY;
+	fs_write(offsetof(struct boot_sector_16, reserved2), 1,
+		 &b16->reserved2);
+    }
+}
+
+int replay_journal(void)
+{
+    struct boot_sector b;
+    struct info_sector i;
+    loff_t start;
+
+    /* Only as much of the boot sector is trusted as is needed to find the
+     * FSINFO sector; the header carries its own checksum */
+    fs_read(0, sizeof(b), &b);
+    if (b.fat_length || !b.fat32_length || !b.info_sector ||
+	le16toh(b.info_sector) >= le16toh(b.reserved))
+	return 0;
+    start = (loff_t) le16toh(b.info_sector) * GET_UNALIGNED_W(b.sector_size);
+    fs_read(start, sizeof(i), &i);
+    if (i.magic != htole32(0x41615252) || i.signature != htole32(0x61417272)
+	|| !(start = journal_sector(&b)))
+	return 0;
+    return fs_replay(start, rw);
+}
+
+/* After a full check, a stamp with a checksum of the first FAT is left in
+ * FSI_Reserved1 of the FSINFO sector, which the specification reserves and
+ * other implementations neither read nor write. As long as the volume was
+ * not marked dirty and its FAT still matches, the directory walk can be
+ * skipped. The stamp is only written by full checks: a skipped one writes
+ * nothing, so that the sectors at the start of the volume are not rewritten
+ * on every boot. FAT12/16 have no FSINFO sector, and their spare reserved
+ * sectors may hold boot code, so they are always checked in full. */
+#define STAMP_MAGIC	0x4b435346	/* "FSCK" */
+
+typedef struct {
+    __u32 magic;
+    __u32 generation;		/* number of full checks */
+    __u32 fat_sum;		/* fat_checksum() after the last full check */
+    __u32 sum;			/* stamp_sum() of all of the above */
+} __attribute__ ((packed)) CHECK_STAMP;
+
+#define STAMP_CHUNK	(64 * 1024)
+
+static uint32_t hash_word(uint32_t hash, uint32_t word)
+{
+    return (hash ^ word) * 16777619U;
+}
+
+static uint32_t fat_checksum(DOS_FS * fs)
+{
+    uint32_t hash = 2166136261U, *words;
+    loff_t pos;
+    int size, i;
+    void *buf;
+
+    buf = talloc(STAMP_CHUNK);
+    for (pos = 0; pos < fs->fat_size; pos += size) {
+	size = fs->fat_size - pos < STAMP_CHUNK ? fs->fat_size - pos :
+	    STAMP_CHUNK;
+	if (!(words = fs_map(fs->fat_start + pos, size))) {
+	    fs_read(fs->fat_start + pos, size, buf);
+	    words = buf;
+	}
+	for (i = 0; i < size / 4; i++)
+	    hash = hash_word(hash, words[i]);
+    }
+    tfree(buf);
+    return hash;
+}
+
+static uint32_t stamp_sum(DOS_FS * fs, CHECK_STAMP * stamp)
+{
+    uint32_t hash = 2166136261U;
+
+    hash = hash_word(hash, le32toh(stamp->magic));
+    hash = hash_word(hash, le32toh(stamp->generation));
+    hash = hash_word(hash, le32toh(stamp->fat_sum));
+    hash = hash_word(hash, fs->clusters);
+    return hash_word(hash, fs->fat_size);
+}
+
+int check_stamp(DOS_FS * fs)
+{
+    CHECK_STAMP stamp;
+
+    if (!fs->stamp_start || fs->was_dirty)
+	return 0;
+    fs_read(fs->stamp_start, sizeof(stamp), &stamp);
+    if (le32toh(stamp.magic) != STAMP_MAGIC ||
+	le32toh(stamp.sum) != stamp_sum(fs, &stamp))
+	return 0;
+    fs->generation = le32toh(stamp.generation);
+    if (le32toh(stamp.fat_sum) != fat_checksum(fs)) {
+	if (verbose)
+	    report("FAT changed since the last full check.\n");
+	return 0;
+    }
+    return 1;
+}
+
+void write_stamp(DOS_FS * fs)
+{
+    CHECK_STAMP stamp;
+
+    if (!fs->stamp_start)
+	return;
+    stamp.magic = htole32(STAMP_MAGIC);
+    stamp.generation = htole32(fs->generation + 1);
+    stamp.fat_sum = htole32(fat_checksum(fs));
+    stamp.sum = htole32(stamp_sum(fs, &stamp));
+    fs_write(fs->stamp_start, sizeof(stamp), &stamp);
+}
@@ -29,4 +29,28 @@ loff_t find_volume_de(DOS_FS * fs, DIR_ENT * de);
 
 /* Reads the boot sector from the currently open device and initializes *FS */
 
+void set_dirty_bit(void);
+
+/* Sets the dirty bit in the boot sector of the open filesystem, so that the
+   next check is a full one. */
+
+int replay_journal(void);
+
+/* Rolls back the last flush of the open filesystem if it was cut short,
+   from the undo journal fs_close left, before anything else is read. Only
+   FAT32 has room for the journal header, in its last reserved sector.
+   Returns a non-zero integer if a flush was rolled back or could not be,
+   see fs_replay. */
+
+int check_stamp(DOS_FS * fs);
+
+/* Returns a non-zero integer if the volume was not marked dirty and its FAT
+   is still the one the last full check left a stamp for. Returns zero if a
+   full check is needed. Nothing is written either way. */
+
+void write_stamp(DOS_FS * fs);
+
+/* Records the current FAT in the stamp after a full check. Does nothing if
+   the filesystem has no room for a stamp. */
+
 #endif
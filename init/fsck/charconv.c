@@ -4,18 +4,28 @@
 #include <locale.h>
 #include <stdio.h>
 
+#include "common.h"
+
 static iconv_t iconv_init_codepage(int codepage)
 {
     iconv_t result;
+    locale_t loc;
     char codepage_name[16];
     snprintf(codepage_name, sizeof(codepage_name), "CP%d", codepage);
-    result = iconv_open(nl_langinfo(CODESET), codepage_name);
+    /* The character set of the environment's locale, looked up without
+     * setlocale(): that would change it for every thread of the process */
+    loc = newlocale(LC_CTYPE_MASK, "", (locale_t) 0);
+    result = iconv_open(loc ? nl_langinfo_l(CODESET, loc) :
+			nl_langinfo(CODESET), codepage_name);
+    if (loc)
+	freelocale(loc);
     if (result == (iconv_t) - 1)
 	perror(codepage_name);
     return result;
 }
 
-static iconv_t dos_to_local;
+static __thread iconv_t dos_to_local;
+static __thread int initialized = -1;
 
 /*
  * Initialize conversion from codepage.
@@ -24,24 +34,29 @@ static iconv_t dos_to_local;
  */
 static int init_conversion(int codepage)
 {
-    static int initialized = -1;
     if (initialized < 0) {
 	initialized = 1;
 	if (codepage < 0)
 	    codepage = DEFAULT_DOS_CODEPAGE;
-	setlocale(LC_ALL, "");	/* initialize locale */
 	dos_to_local = iconv_init_codepage(codepage);
 	if (dos_to_local == (iconv_t) - 1 && codepage != DEFAULT_DOS_CODEPAGE) {
-	    printf("Trying to set fallback DOS codepage %d\n",
+	    report("Trying to set fallback DOS codepage %d\n",
 		   DEFAULT_DOS_CODEPAGE);
 	    dos_to_local = iconv_init_codepage(DEFAULT_DOS_CODEPAGE);
-	    if (dos_to_local == (iconv_t) - 1)
-		initialized = 0;	/* no conversion available */
 	}
+	if (dos_to_local == (iconv_t) - 1)
+	    initialized = 0;	/* no conversion available */
     }
     return initialized;
 }
 
+void close_conversion(void)
+{
+    if (initialized > 0)
+	iconv_close(dos_to_local);
+    initialized = -1;
+}
+
 int set_dos_codepage(int codepage)
 {
     return init_conversion(codepage);
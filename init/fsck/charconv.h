@@ -6,4 +6,9 @@
 int set_dos_codepage(int codepage);
 int dos_char_to_printable(char **p, unsigned char c);
 
+void close_conversion(void);
+
+/* Releases the conversion of the calling thread; the next one sets it up
+   again. */
+
 #endif
@@ -38,7 +38,7 @@
 #include "lfn.h"
 #include "check.h"
 
-static DOS_FILE *root;
+static __thread DOS_FILE *root;
 
 /* get start field of a dir entry */
 #define FSTART(p,fs) \
@@ -75,124 +75,269 @@ static DOS_FILE *root;
     }									\
   } while(0)
 
-loff_t alloc_rootdir_entry(DOS_FS * fs, DIR_ENT * de, const char *pattern)
+/* Number of directory clusters past the current one that are read ahead */
+#define DIR_READ_AHEAD 3
+
+/**
+ * Start reading up to COUNT directory clusters of the chain that follow
+ * CLUSTER.
+ *
+ * @param[in]   fs          Information about the filesystem
+ * @param[in]   cluster     Directory cluster, which is not read itself
+ * @param[in]   count       Number of clusters to read ahead
+ */
+static void read_ahead_dir(DOS_FS * fs, uint32_t cluster, int count)
 {
-    static int curr_num = 0;
-    loff_t offset;
+    FAT_ENTRY next;
+    uint32_t walk;
+    int i;
 
-    if (fs->root_cluster) {
-	DIR_ENT d2;
-	int i = 0, got = 0;
-	uint32_t clu_num, prev = 0;
-	loff_t offset2;
-
-	clu_num = fs->root_cluster;
-	offset = cluster_start(fs, clu_num);
-	while (clu_num > 0 && clu_num != -1) {
-	    fs_read(offset, sizeof(DIR_ENT), &d2);
-	    if (IS_FREE(d2.name) && d2.attr != VFAT_LN_ATTR) {
-		got = 1;
-		break;
-	    }
-	    i += sizeof(DIR_ENT);
-	    offset += sizeof(DIR_ENT);
-	    if ((i % fs->cluster_size) == 0) {
-		prev = clu_num;
-		if ((clu_num = next_cluster(fs, clu_num)) == 0 || clu_num == -1)
-		    break;
-		offset = cluster_start(fs, clu_num);
+    for (walk = cluster, i = 0; i < count; i++) {
+	get_fat(&next, fs->fat, walk);
+	if (next.value < 2 || next.value >= fs->clusters + 2 ||
+	    next.value == cluster)
+	    break;
+	fs_read_ahead(cluster_start(fs, next.value), fs->cluster_size);
+	walk = next.value;
+    }
+}
+
+/**
+ * Load a whole directory cluster with one read and start reading the next
+ * few clusters of the chain, so that the per-entry fs_read calls are served
+ * from memory.
+ *
+ * @param[in]   fs          Information about the filesystem
+ * @param[in]   cluster     Directory cluster about to be scanned
+ */
+static void cache_dir_cluster(DOS_FS * fs, uint32_t cluster)
+{
+    if (cluster < 2 || cluster >= fs->clusters + 2)
+	return;
+    fs_cache(cluster_start(fs, cluster), fs->cluster_size);
+    read_ahead_dir(fs, cluster, DIR_READ_AHEAD);
+}
+
+/* Multiset of the 8.3 names of the entries in a directory, so that finding
+ * out whether a name is taken does not need a walk over all entries. Slots
+ * are never emptied, a name that is no longer used just has a zero count;
+ * they are dropped when the table grows. */
+typedef struct {
+    unsigned char name[MSDOS_NAME];
+    unsigned char used;
+    uint32_t count;
+} NAME_SLOT;
+
+typedef struct {
+    NAME_SLOT *slots;
+    uint32_t size;		/* power of two */
+    uint32_t used;
+} NAME_SET;
+
+static NAME_SLOT *name_slot(NAME_SET * set, const unsigned char *name)
+{
+    uint32_t hash = 2166136261U, i;
+
+    for (i = 0; i < MSDOS_NAME; i++)
+	hash = (hash ^ name[i]) * 16777619U;
+    for (i = hash & (set->size - 1); set->slots[i].used &&
+	 memcmp(set->slots[i].name, name, MSDOS_NAME);
+	 i = (i + 1) & (set->size - 1)) ;
+    return &set->slots[i];
+}
+
+static void name_set_init(NAME_SET * set, uint32_t entries)
+{
+    for (set->size = 16; set->size < entries * 2; set->size *= 2) ;
+    set->slots = talloc(set->size * sizeof(NAME_SLOT));
+    memset(set->slots, 0, set->size * sizeof(NAME_SLOT));
+    set->used = 0;
+}
+
+static void name_set_free(NAME_SET * set)
+{
+    tfree(set->slots);
+    set->slots = NULL;
+}
+
+static void name_set_add(NAME_SET * set, const void *name)
+{
+    NAME_SET old;
+    NAME_SLOT *slot;
+    uint32_t i;
+
+    if ((set->used + 1) * 4 > set->size * 3) {
+	old = *set;
+	name_set_init(set, old.size);
+	for (i = 0; i < old.size; i++)
+	    if (old.slots[i].count) {
+		*name_slot(set, old.slots[i].name) = old.slots[i];
+		set->used++;
 	    }
-	}
-	if (!got) {
-	    /* no free slot, need to extend root dir: alloc next free cluster
-	     * after previous one */
-	    if (!prev)
-		die("Root directory has no cluster allocated!");
-	    for (clu_num = prev + 1; clu_num != prev; clu_num++) {
-		FAT_ENTRY entry;
-
-		if (clu_num >= fs->clusters + 2)
-		    clu_num = 2;
-		get_fat(&entry, fs->fat, clu_num, fs);
-		if (!entry.value)
-		    break;
+	name_set_free(&old);
+    }
+    slot = name_slot(set, name);
+    if (!slot->used) {
+	memcpy(slot->name, name, MSDOS_NAME);
+	slot->used = 1;
+	set->used++;
+    }
+    slot->count++;
+}
+
+static void name_set_remove(NAME_SET * set, const void *name)
+{
+    NAME_SLOT *slot = name_slot(set, name);
+
+    if (slot->count)
+	slot->count--;
+}
+
+static uint32_t name_set_count(NAME_SET * set, const void *name)
+{
+    return name_slot(set, name)->count;
+}
+
+/* What alloc_rootdir_entry needs to know about the root directory, read
+ * once on its first call after scan_root: the names in use, the free slots
+ * in directory order and, for FAT32, the last cluster and where to look for
+ * a free cluster to extend it with. */
+typedef struct {
+    int valid;
+    NAME_SET names;
+    loff_t *free;
+    uint32_t n_free, next_free, max_free;
+    uint32_t last;
+    uint32_t cursor;
+    int name_num;		/* next number alloc_rootdir_entry tries */
+} ROOT_INDEX;
+
+static __thread ROOT_INDEX root_index;
+
+static void root_index_free(void)
+{
+    /* Also after root_index_read failed half way */
+    name_set_free(&root_index.names);
+    tfree(root_index.free);
+    memset(&root_index, 0, sizeof(root_index));
+}
+
+void scan_release(void)
+{
+    root_index_free();
+}
+
+/**
+ * Record the entries of a stretch of the root directory in root_index.
+ *
+ * @param[in]   ents    Entries as read from the filesystem
+ * @param[in]   n       Number of entries
+ * @param[in]   offset  Where the first entry is in the filesystem
+ */
+static void root_index_add(DIR_ENT * ents, int n, loff_t offset)
+{
+    int i;
+
+    for (i = 0; i < n; i++, offset += sizeof(DIR_ENT)) {
+	if (!IS_FREE(ents[i].name))
+	    name_set_add(&root_index.names, ents[i].name);
+	else if (ents[i].attr != VFAT_LN_ATTR) {
+	    if (root_index.n_free == root_index.max_free) {
+		root_index.max_free = root_index.max_free ?
+		    root_index.max_free * 2 : 64;
+		root_index.free = trealloc(root_index.free,
+					   root_index.max_free *
+					   sizeof(loff_t));
 	    }
-	    if (clu_num == prev)
-		die("Root directory full and no free cluster");
-	    set_fat(fs, prev, clu_num);
-	    set_fat(fs, clu_num, -1);
-	    set_owner(fs, clu_num, get_owner(fs, fs->root_cluster));
-	    /* clear new cluster */
-	    memset(&d2, 0, sizeof(d2));
-	    offset = cluster_start(fs, clu_num);
-	    for (i = 0; i < fs->cluster_size; i += sizeof(DIR_ENT))
-		fs_write(offset + i, sizeof(d2), &d2);
+	    root_index.free[root_index.n_free++] = offset;
 	}
-	memset(de, 0, sizeof(DIR_ENT));
-	while (1) {
-	    char expanded[12];
-	    sprintf(expanded, pattern, curr_num);
-	    memcpy(de->name, expanded, 8);
-	    memcpy(de->ext, expanded + 8, 3);
-	    clu_num = fs->root_cluster;
-	    i = 0;
-	    offset2 = cluster_start(fs, clu_num);
-	    while (clu_num > 0 && clu_num != -1) {
-		fs_read(offset2, sizeof(DIR_ENT), &d2);
-		if (offset2 != offset &&
-		    !strncmp((const char *)d2.name, (const char *)de->name,
-			     MSDOS_NAME))
-		    break;
-		i += sizeof(DIR_ENT);
-		offset2 += sizeof(DIR_ENT);
-		if ((i % fs->cluster_size) == 0) {
-		    if ((clu_num = next_cluster(fs, clu_num)) == 0 ||
-			clu_num == -1)
-			break;
-		    offset2 = cluster_start(fs, clu_num);
-		}
-	    }
-	    if (clu_num == 0 || clu_num == -1)
-		break;
-	    if (++curr_num >= 10000)
-		die("Unable to create unique name");
+    }
+}
+
+static void root_index_read(DOS_FS * fs)
+{
+    DIR_ENT *ents;
+    uint32_t clu_num;
+    int n;
+
+    if (fs->root_cluster) {
+	n = fs->cluster_size / sizeof(DIR_ENT);
+	name_set_init(&root_index.names, n);
+	ents = talloc(fs->cluster_size);
+	for (clu_num = fs->root_cluster; clu_num > 0 && clu_num != -1;
+	     clu_num = next_cluster(fs, clu_num)) {
+	    fs_read(cluster_start(fs, clu_num), fs->cluster_size, ents);
+	    root_index_add(ents, n, cluster_start(fs, clu_num));
+	    root_index.last = clu_num;
 	}
+	root_index.cursor = root_index.last + 1;
     } else {
-	DIR_ENT *root;
-	int next_free = 0, scan;
+	n = fs->root_entries;
+	name_set_init(&root_index.names, n);
+	ents = talloc(n * sizeof(DIR_ENT));
+	fs_read(fs->root_start, n * sizeof(DIR_ENT), ents);
+	root_index_add(ents, n, fs->root_start);
+    }
+    tfree(ents);
+    root_index.valid = 1;
+}
+
+/**
+ * Append a cluster to the FAT32 root directory and add its slots to the
+ * free ones.
+ *
+ * @param[inout]    fs      Information about the filesystem
+ */
+static void extend_rootdir(DOS_FS * fs)
+{
+    DIR_ENT d2;
+    uint32_t clu_num, prev = root_index.last;
+    loff_t offset;
+    int i;
 
-	root = alloc(fs->root_entries * sizeof(DIR_ENT));
-	fs_read(fs->root_start, fs->root_entries * sizeof(DIR_ENT), root);
+    if (!prev)
+	die("Root directory has no cluster allocated!");
+    clu_num = next_free_cluster(fs, root_index.cursor);
+    if (!clu_num)
+	die("Root directory full and no free cluster");
+    set_fat(fs, prev, clu_num);
+    set_fat(fs, clu_num, -1);
+    set_owner(fs, clu_num, get_owner(fs, fs->root_cluster));
+    /* clear new cluster */
+    memset(&d2, 0, sizeof(d2));
+    offset = cluster_start(fs, clu_num);
+    for (i = 0; i < fs->cluster_size; i += sizeof(DIR_ENT)) {
+	fs_write(offset + i, sizeof(d2), &d2);
+	root_index_add(&d2, 1, offset + i);
+    }
+    root_index.last = clu_num;
+    root_index.cursor = clu_num + 1;
+}
 
-	while (next_free < fs->root_entries)
-	    if (IS_FREE(root[next_free].name) &&
-		root[next_free].attr != VFAT_LN_ATTR)
-		break;
-	    else
-		next_free++;
-	if (next_free == fs->root_entries)
+loff_t alloc_rootdir_entry(DOS_FS * fs, DIR_ENT * de, const char *pattern)
+{
+    char expanded[12];
+
+    if (!root_index.valid)
+	root_index_read(fs);
+    if (root_index.next_free == root_index.n_free) {
+	if (!fs->root_cluster)
 	    die("Root directory is full.");
-	offset = fs->root_start + next_free * sizeof(DIR_ENT);
-	memset(de, 0, sizeof(DIR_ENT));
-	while (1) {
-	    char expanded[12];
-	    sprintf(expanded, pattern, curr_num);
-	    memcpy(de->name, expanded, 8);
-	    memcpy(de->ext, expanded + 8, 3);
-	    for (scan = 0; scan < fs->root_entries; scan++)
-		if (scan != next_free &&
-		    !strncmp((const char *)root[scan].name,
-			     (const char *)de->name, MSDOS_NAME))
-		    break;
-	    if (scan == fs->root_entries)
-		break;
-	    if (++curr_num >= 10000)
-		die("Unable to create unique name");
-	}
-	free(root);
+	extend_rootdir(fs);
+    }
+    memset(de, 0, sizeof(DIR_ENT));
+    while (1) {
+	sprintf(expanded, pattern, root_index.name_num);
+	memcpy(de->name, expanded, 8);
+	memcpy(de->ext, expanded + 8, 3);
+	if (!name_set_count(&root_index.names, de->name))
+	    break;
+	if (++root_index.name_num >= 10000)
+	    die("Unable to create unique name");
     }
+    name_set_add(&root_index.names, de->name);
     ++n_files;
-    return offset;
+    return root_index.free[root_index.next_free++];
 }
 
 /**
@@ -205,7 +350,7 @@ loff_t alloc_rootdir_entry(DOS_FS * fs, DIR_ENT * de, const char *pattern)
  */
 static char *path_name(DOS_FILE * file)
 {
-    static char path[PATH_MAX * 2];
+    static __thread char path[PATH_MAX * 2];
 
     if (!file)
 	*path = 0;		/* Reached the root directory */
@@ -247,14 +392,14 @@ static time_t date_dos2unix(unsigned short time, unsigned short date)
 
 static char *file_stat(DOS_FILE * file)
 {
-    static char temp[100];
-    struct tm *tm;
+    static __thread char temp[100];
+    struct tm *tm, tm_buf;
     char tmp[100];
     time_t date;
 
     date =
 	date_dos2unix(le16toh(file->dir_ent.time), le16toh(file->dir_ent.date));
-    tm = localtime(&date);
+    tm = localtime_r(&date, &tm_buf);
     strftime(tmp, 99, "%H:%M:%S %b %d %Y", tm);
     sprintf(temp, "  Size %u bytes, date %s", le32toh(file->dir_ent.size), tmp);
     return temp;
@@ -380,14 +525,19 @@ static void truncate_file(DOS_FS * fs, DOS_FILE * file, uint32_t clusters)
     }
 }
 
-static void auto_rename(DOS_FILE * file)
+/**
+ * Give a file a name of the form FSCKnnnnnnn that no other entry in its
+ * directory has.
+ *
+ * @param[inout]    file    Directory entry to rename
+ * @param[in]       names   Names of the other entries in the directory
+ */
+static void auto_rename(DOS_FILE * file, NAME_SET * names)
 {
-    DOS_FILE *first, *walk;
     uint32_t number;
 
     if (!file->offset)
 	return;			/* cannot rename FAT32 root dir */
-    first = file->parent ? file->parent->first : root;
     number = 0;
     while (1) {
 	char num[8];
@@ -395,12 +545,7 @@ static void auto_rename(DOS_FILE * file)
 	memcpy(file->dir_ent.name, "FSCK", 4);
 	memcpy(file->dir_ent.name + 4, num, 4);
 	memcpy(file->dir_ent.ext, num + 4, 3);
-	for (walk = first; walk; walk = walk->next)
-	    if (walk != file
-		&& !strncmp((const char *)walk->dir_ent.name,
-			    (const char *)file->dir_ent.name, MSDOS_NAME))
-		break;
-	if (!walk) {
+	if (!name_set_count(names, file->dir_ent.name)) {
 		/* PATCH ED+DL */
 		if(file->dir_ent.lcase & FAT_NO_83NAME)
 		{
@@ -434,11 +579,11 @@ static void rename_file(DOS_FILE * file)
     unsigned char *walk, *here;
 
     if (!file->offset) {
-	printf("Cannot rename FAT32 root dir\n");
+	report("Cannot rename FAT32 root dir\n");
 	return;			/* cannot rename FAT32 root dir */
     }
     while (1) {
-	printf("New name: ");
+	report("New name: ");
 	fflush(stdout);
 	if (fgets((char *)name, 45, stdin)) {
 	    if ((here = (unsigned char *)strchr((const char *)name, '\n')))
@@ -471,7 +616,8 @@ static void rename_file(DOS_FILE * file)
     }
 }
 
-static int handle_dot(DOS_FS * fs, DOS_FILE * file, int dots)
+static int handle_dot(DOS_FS * fs, DOS_FILE * file, int dots,
+		      NAME_SET * names)
 {
     char *name;
 
@@ -479,19 +625,19 @@ static int handle_dot(DOS_FS * fs, DOS_FILE * file, int dots)
 	strncmp((const char *)file->dir_ent.name, MSDOS_DOT,
 		MSDOS_NAME) ? ".." : ".";
     if (!(file->dir_ent.attr & ATTR_DIR)) {
-	printf("%s\n  Is a non-directory.\n", path_name(file));
+	report("%s\n  Is a non-directory.\n", path_name(file));
 	if (interactive)
-	    printf("1) Drop it\n2) Auto-rename\n3) Rename\n"
+	    report("1) Drop it\n2) Auto-rename\n3) Rename\n"
 		   "4) Convert to directory\n");
 	else
-	    printf("  Auto-renaming it.\n");
+	    report("  Auto-renaming it.\n");
 	switch (interactive ? get_key("1234", "?") : '2') {
 	case '1':
 	    drop_file(fs, file);
 	    return 1;
 	case '2':
-	    auto_rename(file);
-	    printf("  Renamed to %s\n", file_name(file->dir_ent.name));
+	    auto_rename(file, names);
+	    report("  Renamed to %s\n", file_name(file->dir_ent.name));
 	    return 0;
 	case '3':
 	    rename_file(file);
@@ -503,22 +649,103 @@ static int handle_dot(DOS_FS * fs, DOS_FILE * file, int dots)
 	}
     }
     if (!dots) {
-	printf("Root contains directory \"%s\". Dropping it.\n", name);
+	report("Root contains directory \"%s\". Dropping it.\n", name);
 	drop_file(fs, file);
 	return 1;
     }
     return 0;
 }
 
-static int check_file(DOS_FS * fs, DOS_FILE * file)
+/**
+ * Take a file and everything below it that is still in memory out of the
+ * tree. Only the in-memory copies of their entries are marked deleted, as
+ * the entries themselves are no longer part of any directory.
+ *
+ * @param[inout]    top     File to drop
+ */
+static void drop_subtree(DOS_FILE * top)
+{
+    DOS_FILE *walk = top;
+
+    for (;;) {
+	if (!IS_FREE(walk->dir_ent.name) &&
+	    strncmp((const char *)walk->dir_ent.name, MSDOS_DOT, MSDOS_NAME) &&
+	    strncmp((const char *)walk->dir_ent.name, MSDOS_DOTDOT, MSDOS_NAME))
+	    --n_files;
+	walk->dir_ent.name[0] = DELETED_FLAG;
+	if (walk->first) {
+	    walk = walk->first;
+	    continue;
+	}
+	while (walk != top && !walk->next)
+	    walk = walk->parent;
+	if (walk == top)
+	    return;
+	walk = walk->next;
+    }
+}
+
+/**
+ * A directory whose entries were already scanned is cut short. The entries
+ * in the clusters it loses, and all files below them, are no longer part of
+ * the tree: release the clusters they own and make sure none of them is
+ * looked at again. The rest of the tree stays as scanned.
+ *
+ * @param[inout]    fs      Information about the filesystem
+ * @param[inout]    dir     Directory that was truncated
+ * @param[in]       last    Last cluster it keeps, 0 if none
+ * @param[in]       from    First cluster it no longer has
+ */
+static void drop_dir_tail(DOS_FS * fs, DOS_FILE * dir, uint32_t last,
+			  uint32_t from)
+{
+    DOS_FILE *walk;
+    DIR_ENT de;
+    uint64_t *dirs;
+    uint32_t c;
+    loff_t end, pos;
+
+    /* Long name slots at the end of what is kept belong to the first entry
+     * cut off. The entries themselves may have been released already, so
+     * look at the directory itself. */
+    if (last) {
+	end = pos = cluster_start(fs, last) + fs->cluster_size;
+	while (pos > cluster_start(fs, last)) {
+	    fs_read(pos - sizeof(DIR_ENT), sizeof(DIR_ENT), &de);
+	    if (de.attr != VFAT_LN_ATTR || IS_FREE(de.name))
+		break;
+	    pos -= sizeof(DIR_ENT);
+	}
+	if (pos < end) {
+	    report("%s\n  Long file name of the first entry cut off is left "
+		   "behind. Deleting it.\n", path_name(dir));
+	    lfn_remove(pos, end);
+	}
+    }
+
+    dirs = talloc((fs->clusters + 2 + 63) / 64 * sizeof(uint64_t));
+    memset(dirs, 0, (fs->clusters + 2 + 63) / 64 * sizeof(uint64_t));
+    for (c = from; c > 0 && c != -1; c = next_cluster(fs, c))
+	dirs[c / 64] |= 1ULL << (c % 64);
+    disown_entries(fs, dirs);
+    for (walk = dir->first; walk; walk = walk->next) {
+	if (walk->offset < fs->data_start)
+	    continue;
+	c = (walk->offset - fs->data_start) / fs->cluster_size + 2;
+	if (dirs[c / 64] >> (c % 64) & 1)
+	    drop_subtree(walk);
+    }
+    tfree(dirs);
+}
+
+static void check_file(DOS_FS * fs, DOS_FILE * file)
 {
     DOS_FILE *owner;
-    int restart;
     uint32_t expect, curr, this, clusters, prev, walk, clusters2;
 
     if (file->dir_ent.attr & ATTR_DIR) {
 	if (le32toh(file->dir_ent.size)) {
-	    printf("%s\n  Directory has non-zero size. Fixing it.\n",
+	    report("%s\n  Directory has non-zero size. Fixing it.\n",
 		   path_name(file));
 	    MODIFY(file, size, htole32(0));
 	}
@@ -527,11 +754,11 @@ static int check_file(DOS_FS * fs, DOS_FILE * file)
 			MSDOS_NAME)) {
 	    expect = FSTART(file->parent, fs);
 	    if (FSTART(file, fs) != expect) {
-		printf("%s\n  Start (%lu) does not point to parent (%lu)\n",
+		report("%s\n  Start (%lu) does not point to parent (%lu)\n",
 		       path_name(file), (unsigned long)FSTART(file, fs), (long)expect);
 		MODIFY_START(file, expect, fs);
 	    }
-	    return 0;
+	    return;
 	}
 	if (file->parent
 	    && !strncmp((const char *)file->dir_ent.name, MSDOS_DOTDOT,
@@ -541,35 +768,43 @@ static int check_file(DOS_FS * fs, DOS_FILE * file)
 	    if (fs->root_cluster && expect == fs->root_cluster)
 		expect = 0;
 	    if (FSTART(file, fs) != expect) {
-		printf("%s\n  Start (%lu) does not point to .. (%lu)\n",
+		report("%s\n  Start (%lu) does not point to .. (%lu)\n",
 		       path_name(file), (unsigned long)FSTART(file, fs), (unsigned long)expect);
 		MODIFY_START(file, expect, fs);
 	    }
-	    return 0;
+	    return;
 	}
 	if (FSTART(file, fs) == 0) {
-	    printf("%s\n Start does point to root directory. Deleting dir. \n",
+	    report("%s\n Start does point to root directory. Deleting dir. \n",
 		   path_name(file));
 	    MODIFY(file, name[0], DELETED_FLAG);
-	    return 0;
+	    return;
 	}
     }
     if (FSTART(file, fs) >= fs->clusters + 2) {
-	printf
+	report
 	    ("%s\n  Start cluster beyond limit (%lu > %lu). Truncating file.\n",
 	     path_name(file), (unsigned long)FSTART(file, fs), (unsigned long)(fs->clusters + 1));
 	if (!file->offset)
 	    die("Bad FAT32 root directory! (bad start cluster)\n");
 	MODIFY_START(file, 0, fs);
     }
+    /* A simple chain has no free, bad, shared or looping clusters, so only
+     * its length and the clusters owned by others are left to check */
     clusters = prev = 0;
-    for (curr = FSTART(file, fs) ? FSTART(file, fs) :
+    if (chain_is_simple(fs, FSTART(file, fs)))
+	clusters = claim_chain(fs, FSTART(file, fs),
+			       file->dir_ent.attr & ATTR_DIR ? fs->clusters :
+			       ((uint64_t)le32toh(file->dir_ent.size) +
+				fs->cluster_size - 1) / fs->cluster_size,
+			       file);
+    for (curr = !clusters && FSTART(file, fs) ? FSTART(file, fs) :
 	 -1; curr != -1; curr = next_cluster(fs, curr)) {
 	FAT_ENTRY curEntry;
-	get_fat(&curEntry, fs->fat, curr, fs);
+	get_fat(&curEntry, fs->fat, curr);
 
 	if (!curEntry.value || bad_cluster(fs, curr)) {
-	    printf("%s\n  Contains a %s cluster (%lu). Assuming EOF.\n",
+	    report("%s\n  Contains a %s cluster (%lu). Assuming EOF.\n",
 		   path_name(file), curEntry.value ? "bad" : "free", (unsigned long)curr);
 	    if (prev)
 		set_fat(fs, prev, -1);
@@ -581,7 +816,7 @@ static int check_file(DOS_FS * fs, DOS_FILE * file)
 	}
 	if (!(file->dir_ent.attr & ATTR_DIR) && le32toh(file->dir_ent.size) <=
 	    (uint64_t)clusters * fs->cluster_size) {
-	    printf
+	    report
 		("%s\n  File size is %u bytes, cluster chain length is > %lu "
 		 "bytes.\n  Truncating file to %u bytes.\n", path_name(file),
 		 le32toh(file->dir_ent.size),
@@ -592,8 +827,8 @@ static int check_file(DOS_FS * fs, DOS_FILE * file)
 	}
 	if ((owner = get_owner(fs, curr))) {
 	    int do_trunc = 0;
-	    printf("%s  and\n", path_name(owner));
-	    printf("%s\n  share clusters.\n", path_name(file));
+	    report("%s  and\n", path_name(owner));
+	    report("%s\n  share clusters.\n", path_name(file));
 	    clusters2 = 0;
 	    for (walk = FSTART(owner, fs); walk > 0 && walk != -1; walk =
 		 next_cluster(fs, walk))
@@ -601,43 +836,55 @@ static int check_file(DOS_FS * fs, DOS_FILE * file)
 		    break;
 		else
 		    clusters2++;
-	    restart = file->dir_ent.attr & ATTR_DIR;
 	    if (!owner->offset) {
-		printf("  Truncating second to %llu bytes because first "
+		report("  Truncating second to %llu bytes because first "
 		       "is FAT32 root dir.\n",
 		       (unsigned long long)clusters2 * fs->cluster_size);
 		do_trunc = 2;
 	    } else if (!file->offset) {
-		printf("  Truncating first to %llu bytes because second "
+		report("  Truncating first to %llu bytes because second "
 		       "is FAT32 root dir.\n",
 		       (unsigned long long)clusters * fs->cluster_size);
 		do_trunc = 1;
 	    } else if (interactive)
-		printf("1) Truncate first to %llu bytes%s\n"
+		report("1) Truncate first to %llu bytes\n"
 		       "2) Truncate second to %llu bytes\n",
 		       (unsigned long long)clusters * fs->cluster_size,
-		       restart ? " and restart" : "",
 		       (unsigned long long)clusters2 * fs->cluster_size);
 	    else
-		printf("  Truncating second to %llu bytes.\n",
+		report("  Truncating second to %llu bytes.\n",
 		       (unsigned long long)clusters2 * fs->cluster_size);
 	    if (do_trunc != 2
 		&& (do_trunc == 1
 		    || (interactive && get_key("12", "?") == '1'))) {
-		prev = 0;
-		clusters = 0;
+		/* walk follows this through the chain of the owner, whose
+		 * clusters2 clusters before curr are kept */
+		walk = 0;
 		for (this = FSTART(owner, fs); this > 0 && this != -1; this =
 		     next_cluster(fs, this)) {
 		    if (this == curr) {
-			if (prev)
-			    set_fat(fs, prev, -1);
-			else
-			    MODIFY_START(owner, 0, fs);
-			MODIFY(owner, size,
-			       htole32((uint64_t)clusters *
-				       fs->cluster_size));
-			if (restart)
-			    return 1;
+			if (!(owner->dir_ent.attr & ATTR_DIR)) {
+			    if (walk)
+				set_fat(fs, walk, -1);
+			    else
+				MODIFY_START(owner, 0, fs);
+			    MODIFY(owner, size,
+				   htole32((uint64_t)clusters2 *
+					   fs->cluster_size));
+			} else if (walk) {
+			    set_fat(fs, walk, -1);
+			    drop_dir_tail(fs, owner, walk, curr);
+			} else {
+			    /* A directory starting at cluster 0 would be an
+			     * alias of the root directory */
+			    report("  No cluster is left of the first. "
+				   "Deleting it.\n");
+			    drop_dir_tail(fs, owner, 0, curr);
+			    drop_subtree(owner);
+			    MODIFY(owner, name[0], DELETED_FLAG);
+			    if (owner->lfn)
+				lfn_remove(owner->lfn_offset, owner->offset);
+			}
 			while (this > 0 && this != -1) {
 			    set_owner(fs, this, NULL);
 			    this = next_cluster(fs, this);
@@ -645,12 +892,14 @@ static int check_file(DOS_FS * fs, DOS_FILE * file)
 			this = curr;
 			break;
 		    }
-		    clusters++;
-		    prev = this;
+		    walk = this;
 		}
 		if (this != curr)
 		    die("Internal error: didn't find cluster %d in chain"
 			" starting at %d", curr, FSTART(owner, fs));
+		/* The file may have been in what the directory lost */
+		if (IS_FREE(file->dir_ent.name))
+		    return;
 	    } else {
 		if (prev)
 		    set_fat(fs, prev, -1);
@@ -665,7 +914,7 @@ static int check_file(DOS_FS * fs, DOS_FILE * file)
     }
     if (!(file->dir_ent.attr & ATTR_DIR) && le32toh(file->dir_ent.size) >
 	(uint64_t)clusters * fs->cluster_size) {
-	printf
+	report
 	    ("%s\n  File size is %u bytes, cluster chain length is %llu bytes."
 	     "\n  Truncating file to %llu bytes.\n", path_name(file),
 	     le32toh(file->dir_ent.size),
@@ -674,22 +923,20 @@ static int check_file(DOS_FS * fs, DOS_FILE * file)
 	MODIFY(file, size,
 	       htole32((uint64_t)clusters * fs->cluster_size));
     }
-    return 0;
 }
 
-static int check_files(DOS_FS * fs, DOS_FILE * start)
+static void check_files(DOS_FS * fs, DOS_FILE * start)
 {
-    while (start) {
-	if (check_file(fs, start))
-	    return 1;
-	start = start->next;
-    }
-    return 0;
+    /* Entries can be dropped while their siblings are checked */
+    for (; start; start = start->next)
+	if (!IS_FREE(start->dir_ent.name))
+	    check_file(fs, start);
 }
 
 static int check_dir(DOS_FS * fs, DOS_FILE ** root, int dots)
 {
     DOS_FILE *parent, **walk, **scan;
+    NAME_SET names;
     int dot, dotdot, skip, redo;
     int good, bad;
 
@@ -703,12 +950,12 @@ static int check_dir(DOS_FS * fs, DOS_FILE ** root, int dots)
 	else
 	    good++;
     if (*root && parent && good + bad > 4 && bad > good / 2) {
-	printf("%s\n  Has a large number of bad entries. (%d/%d)\n",
+	report("%s\n  Has a large number of bad entries. (%d/%d)\n",
 	       path_name(parent), bad, good + bad);
 	if (!dots)
-	    printf("  Not dropping root directory.\n");
+	    report("  Not dropping root directory.\n");
 	else if (!interactive)
-	    printf("  Not dropping it in auto-mode.\n");
+	    report("  Not dropping it in auto-mode.\n");
 	else if (get_key("yn", "Drop directory ? (y/n)") == 'y') {
 	    truncate_file(fs, parent, 0);
 	    MODIFY(parent, name[0], DELETED_FLAG);
@@ -716,6 +963,13 @@ static int check_dir(DOS_FS * fs, DOS_FILE ** root, int dots)
 	    return 1;
 	}
     }
+    /* The names of all entries still in the list. An entry is removed from
+     * the set while it is being renamed or dropped, and added back under its
+     * new name if it stays in the list. Only entries whose name is there
+     * more than once need to be compared with the later ones. */
+    name_set_init(&names, good + bad);
+    for (walk = root; *walk; walk = &(*walk)->next)
+	name_set_add(&names, (*walk)->dir_ent.name);
     dot = dotdot = redo = 0;
     walk = root;
     while (*walk) {
@@ -723,10 +977,12 @@ static int check_dir(DOS_FS * fs, DOS_FILE ** root, int dots)
 	    ((const char *)((*walk)->dir_ent.name), MSDOS_DOT, MSDOS_NAME)
 	    || !strncmp((const char *)((*walk)->dir_ent.name), MSDOS_DOTDOT,
 			MSDOS_NAME)) {
-	    if (handle_dot(fs, *walk, dots)) {
+	    name_set_remove(&names, (*walk)->dir_ent.name);
+	    if (handle_dot(fs, *walk, dots, &names)) {
 		*walk = (*walk)->next;
 		continue;
 	    }
+	    name_set_add(&names, (*walk)->dir_ent.name);
 	    if (!strncmp
 		((const char *)((*walk)->dir_ent.name), MSDOS_DOT, MSDOS_NAME))
 		dot++;
@@ -734,17 +990,19 @@ static int check_dir(DOS_FS * fs, DOS_FILE ** root, int dots)
 		dotdot++;
 	}
 	if (!((*walk)->dir_ent.attr & ATTR_VOLUME) && bad_name(*walk)) {
-	    puts(path_name(*walk));
-	    printf("  Bad short file name (%s).\n",
+	    report("%s\n", path_name(*walk));
+	    report("  Bad short file name (%s).\n",
 		   file_name((*walk)->dir_ent.name));
 	    if (interactive)
-		printf("1) Drop file\n2) Rename file\n3) Auto-rename\n"
+		report("1) Drop file\n2) Rename file\n3) Auto-rename\n"
 		       "4) Keep it\n");
 	    else
-		printf("  Auto-renaming it.\n");
+		report("  Auto-renaming it.\n");
+	    name_set_remove(&names, (*walk)->dir_ent.name);
 	    switch (interactive ? get_key("1234", "?") : '3') {
 	    case '1':
 		drop_file(fs, *walk);
+		name_set_add(&names, (*walk)->dir_ent.name);
 		walk = &(*walk)->next;
 		continue;
 	    case '2':
@@ -752,59 +1010,71 @@ static int check_dir(DOS_FS * fs, DOS_FILE ** root, int dots)
 		redo = 1;
 		break;
 	    case '3':
-		auto_rename(*walk);
-		printf("  Renamed to %s\n", file_name((*walk)->dir_ent.name));
+		auto_rename(*walk, &names);
+		report("  Renamed to %s\n", file_name((*walk)->dir_ent.name));
 		break;
 	    case '4':
 		break;
 	    }
+	    name_set_add(&names, (*walk)->dir_ent.name);
 	}
 	/* don't check for duplicates of the volume label */
-	if (!((*walk)->dir_ent.attr & ATTR_VOLUME)) {
+	if (!((*walk)->dir_ent.attr & ATTR_VOLUME) &&
+	    name_set_count(&names, (*walk)->dir_ent.name) > 1) {
 	    scan = &(*walk)->next;
 	    skip = 0;
 	    while (*scan && !skip) {
 		if (!((*scan)->dir_ent.attr & ATTR_VOLUME) &&
 		    !memcmp((*walk)->dir_ent.name, (*scan)->dir_ent.name,
 			    MSDOS_NAME)) {
-		    printf("%s\n  Duplicate directory entry.\n  First  %s\n",
+		    report("%s\n  Duplicate directory entry.\n  First  %s\n",
 			   path_name(*walk), file_stat(*walk));
-		    printf("  Second %s\n", file_stat(*scan));
+		    report("  Second %s\n", file_stat(*scan));
 		    if (interactive)
-			printf
+			report
 			    ("1) Drop first\n2) Drop second\n3) Rename first\n"
 			     "4) Rename second\n5) Auto-rename first\n"
 			     "6) Auto-rename second\n");
 		    else
-			printf("  Auto-renaming second.\n");
+			report("  Auto-renaming second.\n");
 		    switch (interactive ? get_key("123456", "?") : '6') {
 		    case '1':
+			name_set_remove(&names, (*walk)->dir_ent.name);
 			drop_file(fs, *walk);
 			*walk = (*walk)->next;
 			skip = 1;
 			break;
 		    case '2':
+			name_set_remove(&names, (*scan)->dir_ent.name);
 			drop_file(fs, *scan);
 			*scan = (*scan)->next;
 			continue;
 		    case '3':
+			name_set_remove(&names, (*walk)->dir_ent.name);
 			rename_file(*walk);
-			printf("  Renamed to %s\n", path_name(*walk));
+			name_set_add(&names, (*walk)->dir_ent.name);
+			report("  Renamed to %s\n", path_name(*walk));
 			redo = 1;
 			break;
 		    case '4':
+			name_set_remove(&names, (*scan)->dir_ent.name);
 			rename_file(*scan);
-			printf("  Renamed to %s\n", path_name(*walk));
+			name_set_add(&names, (*scan)->dir_ent.name);
+			report("  Renamed to %s\n", path_name(*walk));
 			redo = 1;
 			break;
 		    case '5':
-			auto_rename(*walk);
-			printf("  Renamed to %s\n",
+			name_set_remove(&names, (*walk)->dir_ent.name);
+			auto_rename(*walk, &names);
+			name_set_add(&names, (*walk)->dir_ent.name);
+			report("  Renamed to %s\n",
 			       file_name((*walk)->dir_ent.name));
 			break;
 		    case '6':
-			auto_rename(*scan);
-			printf("  Renamed to %s\n",
+			name_set_remove(&names, (*scan)->dir_ent.name);
+			auto_rename(*scan, &names);
+			name_set_add(&names, (*scan)->dir_ent.name);
+			report("  Renamed to %s\n",
 			       file_name((*scan)->dir_ent.name));
 			break;
 		    }
@@ -821,15 +1091,66 @@ static int check_dir(DOS_FS * fs, DOS_FILE ** root, int dots)
 	    dot = dotdot = redo = 0;
 	}
     }
+    name_set_free(&names);
     if (dots && !dot)
-	printf("%s\n  \".\" is missing. Can't fix this yet.\n",
+	report("%s\n  \".\" is missing. Can't fix this yet.\n",
 	       path_name(parent));
     if (dots && !dotdot)
-	printf("%s\n  \"..\" is missing. Can't fix this yet.\n",
+	report("%s\n  \"..\" is missing. Can't fix this yet.\n",
 	       path_name(parent));
     return 0;
 }
 
+/* test_file() reads the clusters of a chain this many at a time */
+#define TEST_AHEAD	256
+
+typedef struct {
+    DOS_FS *fs;
+    uint32_t cluster[TEST_AHEAD];	/* next clusters of the chain */
+    char bad[TEST_AHEAD];		/* cluster[i] could not be read */
+    int n;
+    FS_EXTENT ext[TEST_AHEAD];
+} TEST_WINDOW;
+
+/**
+ * fs_scan callback of test_ahead: flag every occurrence of an unreadable
+ * cluster in the window.
+ */
+static void window_bad(loff_t pos, void *arg)
+{
+    TEST_WINDOW *w = arg;
+    uint32_t cluster = extent_cluster(w->fs, pos);
+    int i;
+
+    for (i = 0; i < w->n; i++)
+	if (w->cluster[i] == cluster)
+	    w->bad[i] = 1;
+}
+
+/**
+ * Read test the clusters of a chain from FIRST on in one go, up to
+ * TEST_AHEAD of them, or up to where test_file stops walking the chain
+ * anyway. A chain that loops back into itself just makes some clusters
+ * appear more than once.
+ */
+static void test_ahead(DOS_FS * fs, TEST_WINDOW * w, uint32_t first)
+{
+    uint32_t walk;
+    int n = 0;
+
+    w->fs = fs;
+    w->n = 0;
+    for (walk = first; walk > 0 && walk < fs->clusters + 2 &&
+	 w->n < TEST_AHEAD; walk = next_cluster(fs, walk)) {
+	if (get_owner(fs, walk) || bad_cluster(fs, walk))
+	    break;
+	w->cluster[w->n] = walk;
+	w->bad[w->n++] = 0;
+	cluster_extent(fs, w->ext, &n, TEST_AHEAD, walk);
+    }
+    fs_scan(w->ext, n, fs->cluster_size, window_bad, w);
+}
+
 /**
  * Check a dentry's cluster chain for bad clusters.
  * If requested, we verify readability and mark unreadable clusters as bad.
@@ -843,7 +1164,18 @@ static void test_file(DOS_FS * fs, DOS_FILE * file, int read_test)
 {
     DOS_FILE *owner;
     uint32_t walk, prev, clusters, next_clu;
+    TEST_WINDOW *window = NULL;
+    int ahead = 0;
 
+    /* Without a read test, the walks below only look for a loop in the
+     * chain, which scan_chains may already have ruled out */
+    if (!read_test && chain_is_simple(fs, FSTART(file, fs)))
+	return;
+
+    if (read_test) {
+	window = talloc(sizeof(TEST_WINDOW));
+	window->n = 0;
+    }
     prev = clusters = 0;
     for (walk = FSTART(file, fs); walk > 0 && walk < fs->clusters + 2;
 	 walk = next_clu) {
@@ -855,7 +1187,7 @@ static void test_file(DOS_FS * fs, DOS_FILE * file, int read_test)
 	 */
 	if ((owner = get_owner(fs, walk))) {
 	    if (owner == file) {
-		printf("%s\n  Circular cluster chain. Truncating to %lu "
+		report("%s\n  Circular cluster chain. Truncating to %lu "
 		       "cluster%s.\n", path_name(file), (unsigned long)clusters,
 		       clusters == 1 ? "" : "s");
 		if (prev)
@@ -870,11 +1202,16 @@ static void test_file(DOS_FS * fs, DOS_FILE * file, int read_test)
 	if (bad_cluster(fs, walk))
 	    break;
 	if (read_test) {
-	    if (fs_test(cluster_start(fs, walk), fs->cluster_size)) {
+	    /* The window was read following the same links as this loop */
+	    if (ahead == window->n) {
+		test_ahead(fs, window, walk);
+		ahead = 0;
+	    }
+	    if (!window->bad[ahead++]) {
 		prev = walk;
 		clusters++;
 	    } else {
-		printf("%s\n  Cluster %lu (%lu) is unreadable. Skipping it.\n",
+		report("%s\n  Cluster %lu (%lu) is unreadable. Skipping it.\n",
 		       path_name(file), (unsigned long)clusters, (unsigned long)walk);
 		if (prev)
 		    set_fat(fs, prev, next_cluster(fs, walk));
@@ -885,6 +1222,7 @@ static void test_file(DOS_FS * fs, DOS_FILE * file, int read_test)
 	}
 	set_owner(fs, walk, file);
     }
+    tfree(window);
     /* Revert ownership (for now) */
     for (walk = FSTART(file, fs); walk > 0 && walk < fs->clusters + 2;
 	 walk = next_cluster(fs, walk))
@@ -909,7 +1247,7 @@ static void undelete(DOS_FS * fs, DOS_FILE * file)
     while (left && (walk >= 2) && (walk < fs->clusters + 2)) {
 
 	FAT_ENTRY curEntry;
-	get_fat(&curEntry, fs->fat, walk, fs);
+	get_fat(&curEntry, fs->fat, walk);
 
 	if (!curEntry.value)
 	    break;
@@ -925,7 +1263,7 @@ static void undelete(DOS_FS * fs, DOS_FILE * file)
     else
 	MODIFY_START(file, 0, fs);
     if (left)
-	printf("Warning: Did only undelete %lu of %lu cluster%s.\n",
+	report("Warning: Did only undelete %lu of %lu cluster%s.\n",
 	       (unsigned long)clusters - left, (unsigned long)clusters, clusters == 1 ? "" : "s");
 
 }
@@ -935,6 +1273,46 @@ static void new_dir(void)
     lfn_reset();
 }
 
+/**
+ * Tell whether a dentry is a subdirectory that the tree walk descends into.
+ *
+ * @param[in]   file    dentry to look at
+ *
+ * @return      Nonzero for a directory other than "." and ".."
+ */
+static int is_subdir(DOS_FILE * file)
+{
+    return (file->dir_ent.attr & ATTR_DIR) &&
+	strncmp((const char *)file->dir_ent.name, MSDOS_DOT, MSDOS_NAME) &&
+	strncmp((const char *)file->dir_ent.name, MSDOS_DOTDOT, MSDOS_NAME);
+}
+
+/* Number of clusters of a newly found subdirectory that are prefetched */
+#define DIR_PREFETCH 2
+
+/**
+ * Ask for the first clusters of a subdirectory as soon as its entry is
+ * found, so that they are on their way while the rest of the tree that is
+ * scanned before it is parsed.
+ *
+ * @param[in]   fs      Information about the filesystem
+ * @param[in]   dir     Subdirectory that was just found
+ */
+static void prefetch_dir(DOS_FS * fs, DOS_FILE * dir)
+{
+    FAT_ENTRY next;
+    uint32_t walk;
+    int i;
+
+    walk = FSTART(dir, fs);
+    for (i = 0; i < DIR_PREFETCH && walk >= 2 && walk < fs->clusters + 2;
+	 i++) {
+	fs_will_need(cluster_start(fs, walk), fs->cluster_size);
+	get_fat(&next, fs->fat, walk);
+	walk = next.value;
+    }
+}
+
 /**
  * Create a description for a referenced dentry and insert it in our dentry
  * tree. Then, go check the dentry's cluster chain for bad clusters and
@@ -959,6 +1337,7 @@ static void add_file(DOS_FS * fs, DOS_FILE *** chain, DOS_FILE * parent,
 	fs_read(offset, sizeof(DIR_ENT), &de);
     else {
 	/* Construct a DIR_ENT for the root directory */
+	memset(&de, 0, sizeof(de));
 	memcpy(de.name, "           ", MSDOS_NAME);
 	de.attr = ATTR_DIR;
 	de.size = de.time = de.date = 0;
@@ -985,27 +1364,53 @@ static void add_file(DOS_FS * fs, DOS_FILE *** chain, DOS_FILE * parent,
     memcpy(&new->dir_ent, &de, sizeof(de));
     new->next = new->first = NULL;
     new->parent = parent;
+    new->owner_id = 0;
     if (type == fdt_undelete)
 	undelete(fs, new);
     **chain = new;
     *chain = &new->next;
     if (list) {
-	printf("Checking file %s", path_name(new));
+	report("Checking file %s", path_name(new));
 	if (new->lfn)
-	    printf(" (%s)", file_name(new->dir_ent.name));	/* (8.3) */
-	printf("\n");
+	    report(" (%s)", file_name(new->dir_ent.name));	/* (8.3) */
+	report("\n");
     }
     /* Don't include root directory, '.', or '..' in the total file count */
     if (offset &&
 	strncmp((const char *)de.name, MSDOS_DOT, MSDOS_NAME) != 0 &&
 	strncmp((const char *)de.name, MSDOS_DOTDOT, MSDOS_NAME) != 0)
 	++n_files;
+    if (offset && is_subdir(new))
+	prefetch_dir(fs, new);
     test_file(fs, new, test);	/* Bad cluster check */
 }
 
-static int subdirs(DOS_FS * fs, DOS_FILE * parent, FDSC ** cp);
+/**
+ * Deallocate the entries of a directory whose whole subtree has been
+ * checked. Only the location of the entries that own clusters is kept.
+ *
+ * @param[inout]    fs      Information about the filesystem
+ * @param[inout]    dir     Directory whose entries are no longer needed
+ * @param[in]       mark    Arena mark taken before the entries were read
+ */
+static void release_dir(DOS_FS * fs, DOS_FILE * dir, QMARK * mark)
+{
+    DOS_FILE *walk;
+
+    for (walk = dir->first; walk; walk = walk->next)
+	release_owner(fs, walk);
+    dir->first = NULL;
+    qrelease(&mem_queue, mark);
+}
 
-static int scan_dir(DOS_FS * fs, DOS_FILE * this, FDSC ** cp)
+/**
+ * Read all entries of a subdirectory into the dentry tree.
+ *
+ * @param[inout]    fs      Information about the filesystem
+ * @param[inout]    this    Directory to read
+ * @param[in]       cp
+ */
+static void read_dir(DOS_FS * fs, DOS_FILE * this, FDSC ** cp)
 {
     DOS_FILE **chain;
     int i;
@@ -1016,6 +1421,8 @@ static int scan_dir(DOS_FS * fs, DOS_FILE * this, FDSC ** cp)
     clu_num = FSTART(this, fs);
     new_dir();
     while (clu_num > 0 && clu_num != -1) {
+	if (!(i % fs->cluster_size))
+	    cache_dir_cluster(fs, clu_num);
 	add_file(fs, &chain, this,
 		 cluster_start(fs, clu_num) + (i % fs->cluster_size), cp);
 	i += sizeof(DIR_ENT);
@@ -1024,63 +1431,106 @@ static int scan_dir(DOS_FS * fs, DOS_FILE * this, FDSC ** cp)
 		break;
     }
     lfn_check_orphaned();
-    if (check_dir(fs, &this->first, this->offset))
-	return 0;
-    if (check_files(fs, this->first))
-	return 1;
-    return subdirs(fs, this, cp);
 }
 
+/* A directory whose subdirectories are being scanned */
+typedef struct {
+    DOS_FILE *dir;		/* NULL for the root directory */
+    DOS_FILE *walk;		/* next entry to look at */
+    FDSC **cp;
+    QMARK mark;			/* taken before the entries of dir were read */
+} SCAN_FRAME;
+
 /**
- * Recursively scan subdirectories of the specified parent directory.
+ * Scan all subdirectories below the root directory, depth first and in
+ * directory order. The directories on the current path are kept on a stack
+ * on the heap instead of recursing, so deeply nested directories cannot
+ * overflow the process stack.
  *
  * @param[inout]    fs      Information about the filesystem
- * @param[in]       parent  Identifies the directory to scan
  * @param[in]       cp
- *
- * @return  0   Success
- * @return  1   Error
  */
-static int subdirs(DOS_FS * fs, DOS_FILE * parent, FDSC ** cp)
+static void scan_tree(DOS_FS * fs, FDSC ** cp)
 {
-    DOS_FILE *walk;
-
-    for (walk = parent ? parent->first : root; walk; walk = walk->next)
-	if (walk->dir_ent.attr & ATTR_DIR)
-	    if (strncmp((const char *)walk->dir_ent.name, MSDOS_DOT, MSDOS_NAME)
-		&& strncmp((const char *)walk->dir_ent.name, MSDOS_DOTDOT,
-			   MSDOS_NAME))
-		if (scan_dir(fs, walk, file_cd(cp, (char *)walk->dir_ent.name)))
-		    return 1;
-    return 0;
+    SCAN_FRAME *stack, *top;
+    DOS_FILE *this;
+    int depth, max_depth;
+
+    max_depth = 16;
+    stack = talloc(max_depth * sizeof(SCAN_FRAME));
+    stack[0].dir = NULL;
+    stack[0].walk = root;
+    stack[0].cp = cp;
+    depth = 1;
+    while (depth) {
+	top = &stack[depth - 1];
+	/* The directory itself may have been dropped, see drop_dir_tail */
+	if (top->dir && IS_FREE(top->dir->dir_ent.name))
+	    top->walk = NULL;
+	while (top->walk && (!is_subdir(top->walk) ||
+			     IS_FREE(top->walk->dir_ent.name)))
+	    top->walk = top->walk->next;
+	if (!top->walk) {
+	    if (top->dir && stream_scan)
+		release_dir(fs, top->dir, &top->mark);
+	    depth--;
+	    continue;
+	}
+	if (fs->deadline && monotime_usec() >= fs->deadline) {
+	    fs->incomplete = 1;
+	    break;
+	}
+	this = top->walk;
+	top->walk = this->next;
+	if (depth == max_depth) {
+	    max_depth *= 2;
+	    stack = trealloc(stack, max_depth * sizeof(SCAN_FRAME));
+	}
+	top = &stack[depth];
+	top->dir = this;
+	top->cp = file_cd(stack[depth - 1].cp, (char *)this->dir_ent.name);
+	/* Everything allocated from here on belongs to the subtree */
+	qmark(&mem_queue, &top->mark);
+	read_dir(fs, this, top->cp);
+	if (check_dir(fs, &this->first, this->offset)) {
+	    if (stream_scan)
+		release_dir(fs, this, &top->mark);
+	    continue;
+	}
+	check_files(fs, this->first);
+	top->walk = this->first;
+	depth++;
+    }
+    tfree(stack);
 }
 
 /**
- * Scan all directory and file information for errors.
+ * Scan all directory and file information for errors. The root directory
+ * and the files in it are always checked in full; if fs->deadline passes
+ * while the subdirectories are scanned, the scan stops there and sets
+ * fs->incomplete.
  *
  * @param[inout]    fs      Information about the filesystem
- *
- * @return  0   Success
- * @return  1   Error
  */
-int scan_root(DOS_FS * fs)
+void scan_root(DOS_FS * fs)
 {
     DOS_FILE **chain;
     int i;
 
+    scan_release();
     root = NULL;
     chain = &root;
     new_dir();
     if (fs->root_cluster) {
 	add_file(fs, &chain, NULL, 0, &fp_root);
     } else {
+	fs_cache(fs->root_start, fs->root_entries * sizeof(DIR_ENT));
 	for (i = 0; i < fs->root_entries; i++)
 	    add_file(fs, &chain, NULL, fs->root_start + i * sizeof(DIR_ENT),
 		     &fp_root);
     }
     lfn_check_orphaned();
     (void)check_dir(fs, &root, 0);
-    if (check_files(fs, root))
-	return 1;
-    return subdirs(fs, NULL, &fp_root);
+    check_files(fs, root);
+    scan_tree(fs, &fp_root);
 }
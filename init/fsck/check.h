@@ -31,10 +31,14 @@ loff_t alloc_rootdir_entry(DOS_FS * fs, DIR_ENT * de, const char *pattern);
    the 'de' structure, the rest of *de is cleared. The offset returned is to
    where in the filesystem the entry belongs. */
 
-int scan_root(DOS_FS * fs);
+void scan_root(DOS_FS * fs);
 
 /* Scans the root directory and recurses into all subdirectories. See check.c
-   for all the details. Returns a non-zero integer if the filesystem has to
-   be checked again. */
+   for all the details. Only the root directory is checked once FS->deadline
+   has passed; FS->incomplete is set if any subdirectory was left out. */
+
+void scan_release(void);
+
+/* Releases what scan_root keeps for later alloc_rootdir_entry calls. */
 
 #endif
@@ -29,19 +29,159 @@
 #include <string.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <time.h>
+#include <setjmp.h>
 
 #include "common.h"
 
-typedef struct _link {
-    void *data;
-    struct _link *next;
-} LINK;
+/* qalloc() hands out memory from QCHUNK sized chunks by bumping a pointer,
+ * so the many small DOS_FILE and name allocations of a directory tree cost
+ * a malloc() only every few hundred calls, sit next to each other in memory,
+ * and are all released by freeing a handful of chunks. ROOT points to the
+ * chunk currently allocated from; older chunks follow it. */
+#define QCHUNK		(64 * 1024)
+#define QALIGN		16
+
+typedef struct _chunk {
+    struct _chunk *next;
+    size_t used, size;		/* bytes of data */
+} CHUNK;
+
+#define CHUNK_HDR	((sizeof(CHUNK) + QALIGN - 1) & ~(size_t) (QALIGN - 1))
+#define CHUNK_DATA(c)	((char *)(c) + CHUNK_HDR)
+
+__thread QSTATS qstats;
+
+/* Every talloc() data area is preceded by this header, which links it into
+ * a list per thread, newest first, for tfree_all() */
+typedef struct _tracked {
+    struct _tracked *prev, *next;
+} TRACKED;
+
+#define TRACKED_HDR	((sizeof(TRACKED) + QALIGN - 1) & ~(size_t) (QALIGN - 1))
+
+static __thread TRACKED *tracked;
+
+/* Reported messages are collected up to this many bytes; more are counted,
+ * but dropped */
+#define REPORT_MAX	(1024 * 1024)
+
+static __thread REPORT *reporting;
+
+/* Where die() and pdie() go instead of terminating the program, see
+ * die_catch() */
+static __thread jmp_buf *die_env;
+static __thread char *die_msg;
+static __thread size_t die_size;
+
+static void report_add(const char *msg, va_list args)
+{
+    REPORT *r = reporting;
+    va_list copy;
+    int len;
+
+    va_copy(copy, args);
+    len = vsnprintf(NULL, 0, msg, copy);
+    va_end(copy);
+    if (len <= 0)
+	return;
+    if (r->len + len >= REPORT_MAX) {
+	r->dropped += len;
+	return;
+    }
+    if (r->len + len >= r->size) {
+	r->size = r->size ? r->size * 2 : 4096;
+	while (r->len + len >= r->size)
+	    r->size *= 2;
+	if (!(r->text = realloc(r->text, r->size)))
+	    pdie("realloc");
+    }
+    vsnprintf(r->text + r->len, len + 1, msg, args);
+    r->len += len;
+}
+
+/**
+ * Write out what was collected so far, so that it is not lost when the
+ * program terminates.
+ */
+static void report_flush(void)
+{
+    if (!reporting || !reporting->len)
+	return;
+    fwrite(reporting->text, 1, reporting->len, stdout);
+    fflush(stdout);
+    reporting->len = 0;
+}
+
+void report(const char *msg, ...)
+{
+    va_list args;
+
+    va_start(args, msg);
+    if (reporting)
+	report_add(msg, args);
+    else
+	vprintf(msg, args);
+    va_end(args);
+}
+
+void summary(const char *msg, ...)
+{
+    va_list args;
+
+    va_start(args, msg);
+    if (reporting)
+	report_add(msg, args);
+    va_end(args);
+    va_start(args, msg);
+    vprintf(msg, args);
+    va_end(args);
+}
+
+void report_collect(REPORT * into)
+{
+    reporting = into;
+}
+
+void report_drain(REPORT * from, void (*line)(const char *text))
+{
+    char *walk, *end, dropped[64];
+
+    for (walk = from->text; walk && walk < from->text + from->len;
+	 walk = end + 1) {
+	if (!(end = memchr(walk, '\n', from->text + from->len - walk)))
+	    end = from->text + from->len;
+	*end = 0;
+	if (*walk)
+	    line(walk);
+    }
+    if (from->dropped) {
+	snprintf(dropped, sizeof(dropped), "%lu more bytes were dropped",
+		 (unsigned long)from->dropped);
+	line(dropped);
+    }
+    free(from->text);
+    memset(from, 0, sizeof(*from));
+}
+
+void die_catch(jmp_buf * env, char *msg, size_t size)
+{
+    die_env = env;
+    die_msg = msg;
+    die_size = size;
+}
 
 void die(char *msg, ...)
 {
     va_list args;
 
     va_start(args, msg);
+    if (die_env) {
+	vsnprintf(die_msg, die_size, msg, args);
+	va_end(args);
+	longjmp(*die_env, 1);
+    }
+    report_flush();
     vfprintf(stderr, msg, args);
     va_end(args);
     fprintf(stderr, "\n");
@@ -51,11 +191,21 @@ void die(char *msg, ...)
 void pdie(char *msg, ...)
 {
     va_list args;
+    int err = errno;
+    size_t len;
 
     va_start(args, msg);
+    if (die_env) {
+	vsnprintf(die_msg, die_size, msg, args);
+	va_end(args);
+	len = strlen(die_msg);
+	snprintf(die_msg + len, die_size - len, ":%s", strerror(err));
+	longjmp(*die_env, 1);
+    }
+    report_flush();
     vfprintf(stderr, msg, args);
     va_end(args);
-    fprintf(stderr, ":%s\n", strerror(errno));
+    fprintf(stderr, ":%s\n", strerror(err));
     exit(1);
 }
 
@@ -69,26 +219,132 @@ void *alloc(int size)
     return NULL;		/* for GCC */
 }
 
+static void *track(TRACKED * this)
+{
+    this->prev = NULL;
+    if ((this->next = tracked))
+	tracked->prev = this;
+    tracked = this;
+    return (char *)this + TRACKED_HDR;
+}
+
+static TRACKED *untrack(void *ptr)
+{
+    TRACKED *this = (TRACKED *) ((char *)ptr - TRACKED_HDR);
+
+    if (this->prev)
+	this->prev->next = this->next;
+    else
+	tracked = this->next;
+    if (this->next)
+	this->next->prev = this->prev;
+    return this;
+}
+
+void *talloc(int size)
+{
+    return track(alloc(TRACKED_HDR + size));
+}
+
+void *trealloc(void *ptr, int size)
+{
+    TRACKED *this;
+
+    if (!ptr)
+	return talloc(size);
+    this = untrack(ptr);
+    if ((ptr = realloc(this, TRACKED_HDR + size)))
+	return track(ptr);
+    track(this);
+    pdie("realloc");
+    return NULL;		/* for GCC */
+}
+
+void tfree(void *ptr)
+{
+    if (ptr)
+	free(untrack(ptr));
+}
+
+void tfree_all(void)
+{
+    TRACKED *this;
+
+    while ((this = tracked)) {
+	tracked = this->next;
+	free(this);
+    }
+}
+
 void *qalloc(void **root, int size)
 {
-    LINK *link;
+    CHUNK *chunk = *root, *new;
+    size_t need;
+
+    need = ((size_t) size + QALIGN - 1) & ~(size_t) (QALIGN - 1);
+    qstats.allocs++;
+    qstats.bytes += need;
+    if ((qstats.live += need) > qstats.peak)
+	qstats.peak = qstats.live;
+    if (!chunk || chunk->size - chunk->used < need) {
+	new = alloc(CHUNK_HDR + (need > QCHUNK ? need : QCHUNK));
+	new->used = 0;
+	new->size = need > QCHUNK ? need : QCHUNK;
+	new->next = chunk;
+	*root = chunk = new;
+	qstats.chunks++;
+    }
+    chunk->used += need;
+    return CHUNK_DATA(chunk) + chunk->used - need;
+}
+
+void qmark(void **root, QMARK * mark)
+{
+    CHUNK *chunk = *root;
+
+    mark->chunk = chunk;
+    mark->used = chunk ? chunk->used : 0;
+}
+
+void qrelease(void **root, QMARK * mark)
+{
+    CHUNK *this;
 
-    link = alloc(sizeof(LINK));
-    link->next = *root;
-    *root = link;
-    return link->data = alloc(size);
+    while (*root != mark->chunk) {
+	this = *root;
+	*root = this->next;
+	qstats.live -= this->used;
+	free(this);
+    }
+    if ((this = *root)) {
+	qstats.live -= this->used - mark->used;
+	this->used = mark->used;
+    }
 }
 
 void qfree(void **root)
 {
-    LINK *this;
+    struct timespec start, end;
+    CHUNK *this;
 
+    clock_gettime(CLOCK_MONOTONIC, &start);
     while (*root) {
-	this = (LINK *) * root;
+	this = *root;
 	*root = this->next;
-	free(this->data);
+	qstats.live -= this->used;
 	free(this);
     }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    qstats.free_usec += (end.tv_sec - start.tv_sec) * 1000000L +
+	(end.tv_nsec - start.tv_nsec) / 1000;
+}
+
+unsigned long long monotime_usec(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
 }
 
 int min(int a, int b)
@@ -106,12 +362,12 @@ char get_key(char *valid, char *prompt)
 	fflush(stdout);
 	while (ch = getchar(), ch == ' ' || ch == '\t') ;
 	if (ch == EOF)
-	    exit(1);
+	    die("Unexpected end of input");
 	if (!strchr(valid, okay = ch))
 	    okay = 0;
 	while (ch = getchar(), ch != '\n' && ch != EOF) ;
 	if (ch == EOF)
-	    exit(1);
+	    die("Unexpected end of input");
 	if (okay)
 	    return okay;
 	printf("Invalid input.\n");
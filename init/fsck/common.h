@@ -21,31 +21,118 @@
 */
 
 #include <asm/types.h>
+#include <stddef.h>
+#include <setjmp.h>
 
 #ifndef _COMMON_H
 #define _COMMON_H
 
 void die(char *msg, ...) __attribute((noreturn));
 
-/* Displays a prinf-style message and terminates the program. */
+/* Displays a prinf-style message and terminates the program, unless
+   die_catch is in effect. */
 
 void pdie(char *msg, ...) __attribute((noreturn));
 
 /* Like die, but appends an error message according to the state of errno. */
 
+void die_catch(jmp_buf * env, char *msg, size_t size);
+
+/* Makes die and pdie on the calling thread store their message in MSG, of
+   SIZE bytes, and longjmp to ENV instead of terminating the program. Nothing
+   is released on the way; the code that set ENV has to clean up. ENV NULL
+   restores the default. */
+
+void report(const char *msg, ...) __attribute((format(printf, 1, 2)));
+
+/* Like printf, but while report_collect is in effect, the message is kept in
+   memory instead of being written to standard output. */
+
+void summary(const char *msg, ...) __attribute((format(printf, 1, 2)));
+
+/* Like report, but the message always goes to standard output too. */
+
+typedef struct report {
+    char *text;
+    size_t len, size;
+    size_t dropped;		/* bytes beyond the limit */
+} REPORT;
+
+void report_collect(REPORT * into);
+
+/* Starts keeping messages reported on the calling thread in INTO, which must
+   be zeroed before first use, or stops it if INTO is NULL. */
+
+void report_drain(REPORT * from, void (*line)(const char *text));
+
+/* Calls LINE for every line collected in FROM, in order, and forgets them. */
+
 void *alloc(int size);
 
 /* mallocs SIZE bytes and returns a pointer to the data. Terminates the program
    if malloc fails. */
 
+void *talloc(int size);
+
+/* Like alloc, but the data area is also tracked per thread, so that
+   tfree_all can deallocate it if it is still allocated then, as it is when
+   die longjmps past the code that would have freed it. */
+
+void *trealloc(void *ptr, int size);
+
+/* Resizes a data area from talloc like realloc, or allocates one if PTR is
+   NULL. Terminates the program if realloc fails. */
+
+void tfree(void *ptr);
+
+/* Deallocates a data area from talloc or trealloc. PTR may be NULL. */
+
+void tfree_all(void);
+
+/* Deallocates every data area talloc'ed on the calling thread that has not
+   been freed yet. */
+
 void *qalloc(void **root, int size);
 
-/* Like alloc, but registers the data area in a list described by ROOT. */
+/* Like alloc, but takes the data area from an arena described by ROOT. The
+   area cannot be freed on its own. */
 
 void qfree(void **root);
 
 /* Deallocates all qalloc'ed data areas described by ROOT. */
 
+typedef struct {
+    void *chunk;
+    size_t used;
+} QMARK;
+
+void qmark(void **root, QMARK * mark);
+
+/* Records the current end of the arena described by ROOT in MARK. */
+
+void qrelease(void **root, QMARK * mark);
+
+/* Deallocates the data areas qalloc'ed from ROOT since qmark recorded MARK.
+   Marks have to be released in the reverse order they were made in. */
+
+typedef struct {
+    unsigned long allocs;	/* qalloc calls */
+    unsigned long bytes;	/* bytes handed out, after alignment */
+    unsigned long live;		/* bytes currently handed out */
+    unsigned long peak;		/* maximum of live */
+    unsigned long chunks;	/* arena chunks malloc'ed */
+    unsigned long free_usec;	/* time spent in qfree */
+} QSTATS;
+
+extern __thread QSTATS qstats;
+
+/* Totals for all arenas of the calling thread since they were last zeroed.
+   Every check zeroes them when it starts. */
+
+unsigned long long monotime_usec(void);
+
+/* Returns the time of CLOCK_MONOTONIC in microseconds. */
+
 int min(int a, int b);
 
 /* Returns the smaller integer value of a and b. */
@@ -53,6 +140,6 @@ int min(int a, int b);
 char get_key(char *valid, char *prompt);
 
 /* Displays PROMPT and waits for user input. Only characters in VALID are
-   accepted. Terminates the program on EOF. Returns the character. */
+   accepted. Calls die on EOF. Returns the character. */
 
 #endif
@@ -28,46 +28,436 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #include "common.h"
 #include "fsck.fat.h"
 #include "io.h"
 #include "check.h"
 #include "fat.h"
+#include "lfn.h"
+
+/* Dirty FAT entries that are at most this far apart are written out as one
+ * piece by flush_fat(), together with the clean entries between them. */
+#define FAT_FLUSH_GAP	32
+
+/* fix_bad() hands runs of free clusters to fs_scan() this many at a time */
+#define SCAN_BATCH	1024
+
+/* Classification of a block of 64 FAT entries, one bit per entry */
+typedef struct {
+    uint64_t used;		/* entry is not zero */
+    uint64_t bad;		/* entry marks a bad cluster */
+    uint64_t range;		/* entry links outside the data area */
+} FAT_MASKS;
+
+#if defined(__SSE2__)
+
+/**
+ * Classify four FAT entries at a time. The entries are masked to 28 bits,
+ * so signed 32-bit compares are good enough.
+ */
+static void fat_masks(DOS_FS * fs, uint32_t first, FAT_MASKS * m)
+{
+    const __m128i *p = (const __m128i *)(fs->fat + first);
+    const __m128i mask = _mm_set1_epi32(0xfffffff);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi32(1);
+    const __m128i min_bad = _mm_set1_epi32(FAT_MIN_BAD(fs));
+    const __m128i max_bad = _mm_set1_epi32(FAT_MAX_BAD(fs));
+    const __m128i limit = _mm_set1_epi32(fs->clusters + 2);
+    __m128i v, below_bad, below_limit;
+    uint64_t free_bits, bad, range;
+    int i;
+
+    m->used = m->bad = m->range = 0;
+    for (i = 0; i < 16; i++) {
+	v = _mm_and_si128(_mm_loadu_si128(p + i), mask);
+	below_bad = _mm_cmpgt_epi32(min_bad, v);
+	below_limit = _mm_cmpgt_epi32(limit, v);
+	free_bits = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, zero)));
+	bad = _mm_movemask_ps(_mm_castsi128_ps(_mm_andnot_si128(
+		below_bad, _mm_andnot_si128(_mm_cmpgt_epi32(v, max_bad),
+					    _mm_cmpeq_epi32(v, v)))));
+	range = _mm_movemask_ps(_mm_castsi128_ps(_mm_or_si128(
+		_mm_cmpeq_epi32(v, one),
+		_mm_andnot_si128(below_limit, below_bad))));
+	m->used |= (~free_bits & 0xf) << (i * 4);
+	m->bad |= bad << (i * 4);
+	m->range |= range << (i * 4);
+    }
+}
+
+#elif defined(__ARM_NEON)
+
+/**
+ * Collapse a NEON compare result into four bits.
+ */
+static inline uint64_t neon_bits(uint32x4_t cmp)
+{
+    static const uint32_t weights[4] = { 1, 2, 4, 8 };
+    uint32x4_t w = vandq_u32(cmp, vld1q_u32(weights));
+    uint32x2_t t = vadd_u32(vget_low_u32(w), vget_high_u32(w));
+
+    return vget_lane_u32(vpadd_u32(t, t), 0);
+}
 
 /**
- * Fetch the FAT entry for a specified cluster.
+ * Classify four FAT entries at a time.
+ */
+static void fat_masks(DOS_FS * fs, uint32_t first, FAT_MASKS * m)
+{
+    const uint32_t *p = fs->fat + first;
+    const uint32x4_t mask = vdupq_n_u32(0xfffffff);
+    const uint32x4_t one = vdupq_n_u32(1);
+    const uint32x4_t min_bad = vdupq_n_u32(FAT_MIN_BAD(fs));
+    const uint32x4_t max_bad = vdupq_n_u32(FAT_MAX_BAD(fs));
+    const uint32x4_t limit = vdupq_n_u32(fs->clusters + 2);
+    uint32x4_t v;
+    int i;
+
+    m->used = m->bad = m->range = 0;
+    for (i = 0; i < 16; i++) {
+	v = vandq_u32(vld1q_u32(p + i * 4), mask);
+	m->used |= neon_bits(vtstq_u32(v, v)) << (i * 4);
+	m->bad |= neon_bits(vandq_u32(vcgeq_u32(v, min_bad),
+				      vcleq_u32(v, max_bad))) << (i * 4);
+	m->range |= neon_bits(vorrq_u32(vceqq_u32(v, one),
+					vandq_u32(vcgeq_u32(v, limit),
+						  vcltq_u32(v, min_bad))))
+	    << (i * 4);
+    }
+}
+
+#else
+
+static void fat_masks(DOS_FS * fs, uint32_t first, FAT_MASKS * m)
+{
+    uint32_t v;
+    uint64_t bit;
+    int i;
+
+    m->used = m->bad = m->range = 0;
+    for (i = 0, bit = 1; i < 64; i++, bit <<= 1) {
+	v = fs->fat[first + i] & 0xfffffff;
+	if (v)
+	    m->used |= bit;
+	if (FAT_IS_BAD(fs, v))
+	    m->bad |= bit;
+	if (v == 1 || (v >= fs->clusters + 2 && v < FAT_MIN_BAD(fs)))
+	    m->range |= bit;
+    }
+}
+
+#endif
+
+/**
+ * Select the entries of a block of 64 that describe data clusters.
+ *
+ * @param[in]	fs          Information about the filesystem
+ * @param[in]	first       First entry of the block, a multiple of 64
+ *
+ * @return  Bit mask of the entries in [2, fs->clusters + 2)
+ */
+static uint64_t valid_mask(DOS_FS * fs, uint32_t first)
+{
+    uint64_t m = ~0ULL;
+
+    if (first == 0)
+	m &= ~3ULL;
+    if (fs->clusters + 2 - first < 64)
+	m &= (1ULL << (fs->clusters + 2 - first)) - 1;
+    return m;
+}
+
+/**
+ * Count the clusters that are neither owned by a file nor marked bad.
+ *
+ * @param[in]	fs          Information about the filesystem
+ *
+ * @return  Number of free clusters
+ */
+static uint32_t count_free(DOS_FS * fs)
+{
+    FAT_MASKS m;
+    uint32_t i, free = 0;
+
+    for (i = 0; i < fs->clusters + 2; i += 64) {
+	fat_masks(fs, i, &m);
+	free += __builtin_popcountll(~fs->owned[i / 64] & ~m.bad &
+				     valid_mask(fs, i));
+    }
+    return free;
+}
+
+/**
+ * Decode the first entries of an on-disk FAT.
  *
- * @param[out]  entry	    Cluster to which cluster of interest is linked
- * @param[in]	fat	    FAT table for the partition
- * @param[in]	cluster     Cluster of interest
  * @param[in]	fs          Information from the FAT boot sectors (bits per FAT entry)
+ * @param[in]	raw         FAT as stored on disk
+ * @param[out]  out         Decoded entries
+ * @param[in]	n           Number of entries to decode
  */
-void get_fat(FAT_ENTRY * entry, void *fat, uint32_t cluster, DOS_FS * fs)
+static void decode_fat(DOS_FS * fs, const unsigned char *raw, uint32_t *out,
+		       uint32_t n)
 {
-    unsigned char *ptr;
+    uint32_t i;
 
     switch (fs->fat_bits) {
     case 12:
-	ptr = &((unsigned char *)fat)[cluster * 3 / 2];
-	entry->value = 0xfff & (cluster & 1 ? (ptr[0] >> 4) | (ptr[1] << 4) :
-				(ptr[0] | ptr[1] << 8));
+	for (i = 0; i + 1 < n; i += 2, raw += 3) {
+	    out[i] = raw[0] | (raw[1] & 0x0f) << 8;
+	    out[i + 1] = raw[1] >> 4 | raw[2] << 4;
+	}
+	if (i < n)
+	    out[i] = raw[0] | (raw[1] & 0x0f) << 8;
 	break;
     case 16:
-	entry->value = le16toh(((unsigned short *)fat)[cluster]);
+	for (i = 0; i < n; i++)
+	    out[i] = le16toh(((const unsigned short *)raw)[i]);
 	break;
     case 32:
-	/* According to M$, the high 4 bits of a FAT32 entry are reserved and
-	 * are not part of the cluster number. So we cut them off. */
-	{
-	    uint32_t e = le32toh(((unsigned int *)fat)[cluster]);
-	    entry->value = e & 0xfffffff;
-	    entry->reserved = e >> 28;
+	for (i = 0; i < n; i++)
+	    out[i] = le32toh(((const unsigned int *)raw)[i]);
+	break;
+    default:
+	die("Bad FAT entry size: %d bits.", fs->fat_bits);
+    }
+}
+
+/**
+ * Encode FAT entries and queue them for writing.
+ *
+ * @param[in]	fs          Information about the filesystem
+ * @param[in]	first       First entry to write
+ * @param[in]	last        Entry after the last one to write
+ */
+static void write_fat(DOS_FS * fs, uint32_t first, uint32_t last)
+{
+    unsigned char *buf, *p;
+    uint32_t i, eff_size;
+    loff_t offs;
+    int size;
+
+    eff_size = ((fs->clusters + 2ULL) * fs->fat_bits + 7) / 8;
+    switch (fs->fat_bits) {
+    case 12:
+	/* Two entries share three bytes; always encode whole pairs. The
+	 * entry after the last cluster is a zero sentinel in fs->fat. */
+	first &= ~1;
+	last = (last + 1) & ~1;
+	offs = first * 3 / 2;
+	size = (last - first) * 3 / 2;
+	p = buf = talloc(size);
+	for (i = first; i < last; i += 2, p += 3) {
+	    p[0] = fs->fat[i];
+	    p[1] = (fs->fat[i] >> 8 & 0x0f) | fs->fat[i + 1] << 4;
+	    p[2] = fs->fat[i + 1] >> 4;
+	}
+	if (offs + size > eff_size)
+	    size = eff_size - offs;
+	break;
+    case 16:
+	offs = first * 2;
+	size = (last - first) * 2;
+	p = buf = talloc(size);
+	for (i = first; i < last; i++, p += 2) {
+	    p[0] = fs->fat[i];
+	    p[1] = fs->fat[i] >> 8;
+	}
+	break;
+    case 32:
+	offs = first * 4ULL;
+	size = (last - first) * 4;
+	p = buf = talloc(size);
+	for (i = first; i < last; i++, p += 4) {
+	    p[0] = fs->fat[i];
+	    p[1] = fs->fat[i] >> 8;
+	    p[2] = fs->fat[i] >> 16;
+	    p[3] = fs->fat[i] >> 24;
 	}
 	break;
     default:
 	die("Bad FAT entry size: %d bits.", fs->fat_bits);
     }
+    /* Other FAT copies are mirrors of the first one, see read_boot */
+    fs_write(fs->fat_start + offs, size, buf);
+    tfree(buf);
+}
+
+/**
+ * Find the next entry marked dirty by set_fat.
+ *
+ * @param[in]	fs          Information about the filesystem
+ * @param[in]	from        First entry to look at
+ *
+ * @return      The entry, or the number of FAT entries if there is none
+ */
+static uint32_t next_dirty(DOS_FS * fs, uint32_t from)
+{
+    uint32_t n = fs->clusters + 2, w = from / 64;
+    uint64_t bits;
+
+    if (from >= n)
+	return n;
+    bits = fs->fat_dirty[w] & (~0ULL << (from % 64));
+    while (!bits) {
+	if (++w * 64 >= n)
+	    return n;
+	bits = fs->fat_dirty[w];
+    }
+    return w * 64 + __builtin_ctzll(bits);
+}
+
+void flush_fat(DOS_FS * fs)
+{
+    uint32_t n, start, end, i;
+
+    if (!fs->fat)
+	return;
+    n = fs->clusters + 2;
+    for (i = next_dirty(fs, 0); i < n;) {
+	start = i;
+	end = i + 1;
+	while ((i = next_dirty(fs, end)) < n && i - end < FAT_FLUSH_GAP)
+	    end = i + 1;
+	write_fat(fs, start, end);
+    }
+    memset(fs->fat_dirty, 0, (n + 63) / 64 * sizeof(uint64_t));
+}
+
+/* Flags a span_owner word that refers to an owner page */
+#define OWNER_PAGE	0x80000000
+
+/* Stand-ins for released owners, see get_owner() */
+static __thread void *stub_queue;
+
+/**
+ * Set up empty ownership tracking for all clusters.
+ *
+ * @param[in,out]   fs          Information about the filesystem
+ */
+static void alloc_owners(DOS_FS * fs)
+{
+    uint32_t spans = (fs->clusters + 2 + 63) / 64;
+
+    fs->owned = alloc(spans * sizeof(uint64_t));
+    memset(fs->owned, 0, spans * sizeof(uint64_t));
+    fs->span_owner = alloc(spans * sizeof(uint32_t));
+    memset(fs->span_owner, 0, spans * sizeof(uint32_t));
+    fs->owner_pages = NULL;
+    fs->n_owner_pages = 0;
+    fs->owners = NULL;
+    fs->n_owners = fs->max_owners = 0;
+    fs->owner_offset = NULL;
+    fs->owner_parent = NULL;
+    fs->owner_stubs = NULL;
+}
+
+/**
+ * Release the ownership tracking set up by alloc_owners().
+ *
+ * @param[in,out]   fs          Information about the filesystem
+ */
+static void free_owners(DOS_FS * fs)
+{
+    free(fs->owned);
+    free(fs->span_owner);
+    free(fs->owner_pages);
+    free(fs->owners);
+    free(fs->owner_offset);
+    free(fs->owner_parent);
+    free(fs->owner_stubs);
+    qfree(&stub_queue);
+    fs->owned = NULL;
+    fs->span_owner = NULL;
+    fs->owner_pages = NULL;
+    fs->owners = NULL;
+    fs->owner_offset = NULL;
+    fs->owner_parent = NULL;
+    fs->owner_stubs = NULL;
+}
+
+/* FAT copies are compared in chunks of this many bytes. It is a multiple of
+ * three, so chunks start at an entry boundary for every FAT width. */
+#define FAT_CHUNK	(192 * 1024)
+
+/* Granularity at which differences between FAT copies are recorded */
+#define FAT_DIFF_BLOCK	512
+
+/* A range in which the FAT copies differ */
+typedef struct {
+    uint32_t offs;		/* byte offset into the FAT */
+    int size;
+    unsigned char *data[2];	/* contents in the first and second FAT */
+} FAT_DIFF;
+
+/**
+ * Record a range in which the FAT copies differ, merging it with the
+ * previous one if they are adjacent.
+ */
+static void add_diff(FAT_DIFF ** diffs, int *n, int *max, uint32_t offs,
+		     int size, const unsigned char *first,
+		     const unsigned char *second)
+{
+    FAT_DIFF *d = *n ? &(*diffs)[*n - 1] : NULL;
+    int i;
+
+    if (d && d->offs + d->size == offs) {
+	for (i = 0; i < 2; i++)
+	    d->data[i] = trealloc(d->data[i], d->size + size);
+    } else {
+	if (*n == *max) {
+	    *max = *max ? *max * 2 : 16;
+	    *diffs = trealloc(*diffs, *max * sizeof(FAT_DIFF));
+	}
+	d = &(*diffs)[(*n)++];
+	d->offs = offs;
+	d->size = 0;
+	d->data[0] = talloc(size);
+	d->data[1] = talloc(size);
+    }
+    memcpy(d->data[0] + d->size, first, size);
+    memcpy(d->data[1] + d->size, second, size);
+    d->size += size;
+}
+
+/**
+ * Make the FAT copies agree by overwriting the ranges in which they differ.
+ *
+ * @param[in,out]   fs          Information about the filesystem
+ * @param[in]	    diffs       Ranges in which the copies differ
+ * @param[in]	    n           Number of ranges
+ * @param[in]	    winner      0 to keep the first FAT, 1 for the second
+ */
+static void repair_fat(DOS_FS * fs, FAT_DIFF * diffs, int n, int winner)
+{
+    uint32_t first, last, total = fs->clusters + 2;
+    unsigned char *raw;
+    int i, size;
+
+    for (i = 0; i < n; i++) {
+	fs_write(fs->fat_start + (winner ? 0 : fs->fat_size) + diffs[i].offs,
+		 diffs[i].size, diffs[i].data[winner]);
+	if (!winner)
+	    continue;
+	/* The decoded FAT came from the first copy; decode the replaced
+	 * entries again, from whole FAT12 pairs */
+	first = (uint64_t)diffs[i].offs * 8 / fs->fat_bits & ~1;
+	last = ((uint64_t)(diffs[i].offs + diffs[i].size) * 8 +
+		fs->fat_bits - 1) / fs->fat_bits;
+	if (last > total)
+	    last = total;
+	size = ((uint64_t)(last - first) * fs->fat_bits + 7) / 8;
+	raw = talloc(size);
+	fs_read(fs->fat_start + (uint64_t)first * fs->fat_bits / 8, size, raw);
+	decode_fat(fs, raw, fs->fat + first, last - first);
+	tfree(raw);
+    }
 }
 
 /**
@@ -78,95 +468,235 @@ void get_fat(FAT_ENTRY * entry, void *fat, uint32_t cluster, DOS_FS * fs)
  *
  * @param[inout]    fs      Information about the filesystem
  */
+void free_fat(DOS_FS * fs)
+{
+    free(fs->fat);
+    free(fs->fat_dirty);
+    free_owners(fs);
+    free(fs->simple_chain);
+    fs->fat = NULL;
+    fs->fat_dirty = NULL;
+    fs->simple_chain = NULL;
+}
+
 void read_fat(DOS_FS * fs)
 {
-    int eff_size;
-    uint32_t i;
-    void *first, *second = NULL;
-    int first_ok, second_ok;
-    uint32_t total_num_clusters;
+    uint32_t eff_size, offs, i, j;
+    unsigned char *chunk[2] = { NULL, NULL }, *a, *b;
+    int first_ok = 1, second_ok = 1, len, n_diffs = 0, max_diffs = 0;
+    uint32_t total_num_clusters, fat_entries, value, entry, media[2];
+    uint64_t bits;
+    FAT_MASKS m;
+    FAT_DIFF *diffs = NULL;
+    FS_IO io[2];
 
-    /* Clean up from previous pass */
-    if (fs->fat)
-	free(fs->fat);
-    if (fs->cluster_owner)
-	free(fs->cluster_owner);
-    fs->fat = NULL;
-    fs->cluster_owner = NULL;
+    /* Clean up from previous pass. Changes made to the decoded FAT have to
+     * be queued first, as the FAT is read back through them. */
+    flush_fat(fs);
+    free_fat(fs);
 
     total_num_clusters = fs->clusters + 2UL;
     eff_size = (total_num_clusters * fs->fat_bits + 7) / 8ULL;
-    first = alloc(eff_size);
-    fs_read(fs->fat_start, eff_size, first);
-    if (fs->nfats > 1) {
-	second = alloc(eff_size);
-	fs_read(fs->fat_start + fs->fat_size, eff_size, second);
-    }
-    if (second && memcmp(first, second, eff_size) != 0) {
-	FAT_ENTRY first_media, second_media;
-	get_fat(&first_media, first, 0, fs);
-	get_fat(&second_media, second, 0, fs);
-	first_ok = (first_media.value & FAT_EXTD(fs)) == FAT_EXTD(fs);
-	second_ok = (second_media.value & FAT_EXTD(fs)) == FAT_EXTD(fs);
+
+    /* Zero entries pad the table to a whole number of 64-entry blocks for
+     * fat_masks. There is at least one, which keeps write_fat from having
+     * to special-case the last FAT12 pair. */
+    fat_entries = (total_num_clusters + 64) & ~63;
+    fs->fat = alloc(fat_entries * sizeof(uint32_t));
+    memset(fs->fat + total_num_clusters, 0,
+	   (fat_entries - total_num_clusters) * sizeof(uint32_t));
+    fs->fat_dirty = alloc((total_num_clusters + 63) / 64 * sizeof(uint64_t));
+    memset(fs->fat_dirty, 0, (total_num_clusters + 63) / 64 * sizeof(uint64_t));
+
+    /* Decode the first FAT a chunk at a time, comparing it against the
+     * second one on the way. Only the ranges that differ are kept. */
+    for (offs = 0; offs < eff_size; offs += len) {
+	len = eff_size - offs < FAT_CHUNK ? eff_size - offs : FAT_CHUNK;
+	b = NULL;
+	if ((a = fs_map(fs->fat_start + offs, len))) {
+	    if (fs->nfats > 1)
+		b = fs_map(fs->fat_start + fs->fat_size + offs, len);
+	} else {
+	    if (!chunk[0]) {
+		chunk[0] = talloc(FAT_CHUNK);
+		if (fs->nfats > 1)
+		    chunk[1] = talloc(FAT_CHUNK);
+	    }
+	    io[0].pos = fs->fat_start + offs;
+	    io[0].size = len;
+	    io[0].data = a = chunk[0];
+	    io[1].pos = fs->fat_start + fs->fat_size + offs;
+	    io[1].size = len;
+	    io[1].data = b = chunk[1];
+	    fs_read_batch(io, b ? 2 : 1);
+	}
+	entry = (uint64_t)offs * 8 / fs->fat_bits;
+	decode_fat(fs, a, fs->fat + entry,
+		   total_num_clusters - entry < (uint64_t)FAT_CHUNK * 8 /
+		   fs->fat_bits ? total_num_clusters - entry :
+		   (uint64_t)FAT_CHUNK * 8 / fs->fat_bits);
+	if (!b)
+	    continue;
+	if (!offs) {
+	    decode_fat(fs, a, &media[0], 1);
+	    decode_fat(fs, b, &media[1], 1);
+	    first_ok = (media[0] & FAT_EXTD(fs)) == FAT_EXTD(fs);
+	    second_ok = (media[1] & FAT_EXTD(fs)) == FAT_EXTD(fs);
+	}
+	if (memcmp(a, b, len) == 0)
+	    continue;
+	for (i = 0; i < len; i += FAT_DIFF_BLOCK) {
+	    j = len - i < FAT_DIFF_BLOCK ? len - i : FAT_DIFF_BLOCK;
+	    if (memcmp(a + i, b + i, j))
+		add_diff(&diffs, &n_diffs, &max_diffs, offs + i, j, a + i,
+			 b + i);
+	}
+    }
+    tfree(chunk[0]);
+    tfree(chunk[1]);
+
+    if (n_diffs) {
 	if (first_ok && !second_ok) {
-	    printf("FATs differ - using first FAT.\n");
-	    fs_write(fs->fat_start + fs->fat_size, eff_size, first);
+	    report("FATs differ - using first FAT.\n");
+	    repair_fat(fs, diffs, n_diffs, 0);
 	}
 	if (!first_ok && second_ok) {
-	    printf("FATs differ - using second FAT.\n");
-	    fs_write(fs->fat_start, eff_size, second);
-	    memcpy(first, second, eff_size);
+	    report("FATs differ - using second FAT.\n");
+	    repair_fat(fs, diffs, n_diffs, 1);
 	}
 	if (first_ok && second_ok) {
 	    if (interactive) {
-		printf("FATs differ but appear to be intact. Use which FAT ?\n"
+		report("FATs differ but appear to be intact. Use which FAT ?\n"
 		       "1) Use first FAT\n2) Use second FAT\n");
 		if (get_key("12", "?") == '1') {
-		    fs_write(fs->fat_start + fs->fat_size, eff_size, first);
+		    repair_fat(fs, diffs, n_diffs, 0);
 		} else {
-		    fs_write(fs->fat_start, eff_size, second);
-		    memcpy(first, second, eff_size);
+		    repair_fat(fs, diffs, n_diffs, 1);
 		}
 	    } else {
-		printf("FATs differ but appear to be intact. Using first "
+		report("FATs differ but appear to be intact. Using first "
 		       "FAT.\n");
-		fs_write(fs->fat_start + fs->fat_size, eff_size, first);
+		repair_fat(fs, diffs, n_diffs, 0);
 	    }
 	}
 	if (!first_ok && !second_ok) {
-	    printf("Both FATs appear to be corrupt. Giving up.\n");
-	    exit(1);
+	    die("Both FATs appear to be corrupt. Giving up.");
 	}
+	for (i = 0; i < n_diffs; i++) {
+	    tfree(diffs[i].data[0]);
+	    tfree(diffs[i].data[1]);
+	}
+	tfree(diffs);
     }
-    if (second) {
-	free(second);
-    }
-    fs->fat = (unsigned char *)first;
 
-    fs->cluster_owner = alloc(total_num_clusters * sizeof(DOS_FILE *));
-    memset(fs->cluster_owner, 0, (total_num_clusters * sizeof(DOS_FILE *)));
+    alloc_owners(fs);
+    fs->free_count = -1;
 
     /* Truncate any cluster chains that link to something out of range */
-    for (i = 2; i < fs->clusters + 2; i++) {
-	FAT_ENTRY curEntry;
-	get_fat(&curEntry, fs->fat, i, fs);
-	if (curEntry.value == 1) {
-	    printf("Cluster %ld out of range (1). Setting to EOF.\n", (long)(i - 2));
-	    set_fat(fs, i, -1);
+    for (i = 0; i < total_num_clusters; i += 64) {
+	fat_masks(fs, i, &m);
+	for (bits = m.range & valid_mask(fs, i); bits; bits &= bits - 1) {
+	    uint32_t c = i + __builtin_ctzll(bits);
+	    value = fs->fat[c] & 0xfffffff;
+	    if (value == 1)
+		report("Cluster %ld out of range (1). Setting to EOF.\n",
+		       (long)(c - 2));
+	    else
+		report("Cluster %ld out of range (%ld > %ld). Setting to EOF.\n",
+		       (long)(c - 2), (long)value, (long)(fs->clusters + 2 - 1));
+	    set_fat(fs, c, -1);
 	}
-	if (curEntry.value >= fs->clusters + 2 &&
-	    (curEntry.value < FAT_MIN_BAD(fs))) {
-	    printf("Cluster %ld out of range (%ld > %ld). Setting to EOF.\n",
-		   (long)(i - 2), (long)curEntry.value, (long)(fs->clusters + 2 - 1));
-	    set_fat(fs, i, -1);
+    }
+    scan_chains(fs);
+}
+
+void scan_chains(DOS_FS * fs)
+{
+    uint32_t n = fs->clusters + 2, words = (n + 63) / 64, c, walk, next;
+    uint64_t *linked, *shared, bit;
+    int simple;
+
+    free(fs->simple_chain);
+    linked = alloc(words * sizeof(uint64_t));
+    shared = alloc(words * sizeof(uint64_t));
+    fs->simple_chain = alloc(words * sizeof(uint64_t));
+    memset(linked, 0, words * sizeof(uint64_t));
+    memset(shared, 0, words * sizeof(uint64_t));
+    memset(fs->simple_chain, 0, words * sizeof(uint64_t));
+
+    /* In-degrees, saturated at two: linked is set for clusters something
+     * links to, shared for those more than one cluster links to */
+    for (c = 2; c < n; c++) {
+	next = fs->fat[c] & 0xfffffff;
+	if (next < 2 || next >= n)
+	    continue;
+	bit = 1ULL << (next % 64);
+	if (linked[next / 64] & bit)
+	    shared[next / 64] |= bit;
+	linked[next / 64] |= bit;
+    }
+
+    /* Walk from every chain head. Every cluster that is linked to exactly
+     * once is reached by at most one walk, and walks stop at shared
+     * clusters, so this is linear in the number of clusters too. A walk
+     * cannot loop: the loop would have to be entered through a shared
+     * cluster, or lead back to the head, which nothing links to. */
+    for (c = 2; c < n; c++) {
+	next = fs->fat[c] & 0xfffffff;
+	if (!next || (linked[c / 64] & (1ULL << (c % 64))))
+	    continue;
+	simple = 1;
+	for (walk = c;; walk = next) {
+	    next = fs->fat[walk] & 0xfffffff;
+	    if (FAT_IS_BAD(fs, next)) {
+		simple = 0;
+		break;
+	    }
+	    /* A free cluster on the chain makes check_file cut it short */
+	    if (next < 2) {
+		simple = 0;
+		break;
+	    }
+	    if (next >= n)
+		break;
+	    if (shared[next / 64] & (1ULL << (next % 64))) {
+		simple = 0;
+		break;
+	    }
 	}
+	if (simple)
+	    fs->simple_chain[c / 64] |= 1ULL << (c % 64);
     }
+    free(linked);
+    free(shared);
+}
+
+int chain_is_simple(DOS_FS * fs, uint32_t start)
+{
+    return fs->simple_chain && start >= 2 && start < fs->clusters + 2 &&
+	(fs->simple_chain[start / 64] & (1ULL << (start % 64)));
+}
+
+uint32_t claim_chain(DOS_FS * fs, uint32_t start, uint32_t max,
+		     DOS_FILE * owner)
+{
+    uint32_t n = fs->clusters + 2, walk, count = 0;
+
+    for (walk = start; walk >= 2 && walk < n;
+	 walk = fs->fat[walk] & 0xfffffff) {
+	if (++count > max || (fs->owned[walk / 64] & (1ULL << (walk % 64))))
+	    return 0;
+    }
+    for (walk = start; walk >= 2 && walk < n;
+	 walk = fs->fat[walk] & 0xfffffff)
+	set_owner(fs, walk, owner);
+    return count;
 }
 
 /**
  * Update the FAT entry for a specified cluster
  * (i.e., change the cluster it links to).
- * Queue a command to write out this change.
+ * The change is queued for writing by the next flush_fat().
  *
  * @param[in,out]   fs          Information about the filesystem
  * @param[in]	    cluster     Cluster to change
@@ -178,65 +708,29 @@ void read_fat(DOS_FS * fs)
  */
 void set_fat(DOS_FS * fs, uint32_t cluster, int32_t new)
 {
-    unsigned char *data = NULL;
-    int size;
-    loff_t offs;
-
     if (new == -1)
 	new = FAT_EOF(fs);
     else if ((long)new == -2)
 	new = FAT_BAD(fs);
-    switch (fs->fat_bits) {
-    case 12:
-	data = fs->fat + cluster * 3 / 2;
-	offs = fs->fat_start + cluster * 3 / 2;
-	if (cluster & 1) {
-	    FAT_ENTRY prevEntry;
-	    get_fat(&prevEntry, fs->fat, cluster - 1, fs);
-	    data[0] = ((new & 0xf) << 4) | (prevEntry.value >> 8);
-	    data[1] = new >> 4;
-	} else {
-	    FAT_ENTRY subseqEntry;
-	    get_fat(&subseqEntry, fs->fat, cluster + 1, fs);
-	    data[0] = new & 0xff;
-	    data[1] = (new >> 8) | (cluster == fs->clusters - 1 ? 0 :
-				    (0xff & subseqEntry.value) << 4);
-	}
-	size = 2;
-	break;
-    case 16:
-	data = fs->fat + cluster * 2;
-	offs = fs->fat_start + cluster * 2;
-	*(unsigned short *)data = htole16(new);
-	size = 2;
-	break;
-    case 32:
-	{
-	    FAT_ENTRY curEntry;
-	    get_fat(&curEntry, fs->fat, cluster, fs);
-
-	    data = fs->fat + cluster * 4;
-	    offs = fs->fat_start + cluster * 4;
-	    /* According to M$, the high 4 bits of a FAT32 entry are reserved and
-	     * are not part of the cluster number. So we never touch them. */
-	    *(uint32_t *)data = htole32((new & 0xfffffff) |
-					     (curEntry.reserved << 28));
-	    size = 4;
-	}
-	break;
-    default:
-	die("Bad FAT entry size: %d bits.", fs->fat_bits);
-    }
-    fs_write(offs, size, data);
-    if (fs->nfats > 1) {
-	fs_write(offs + fs->fat_size, size, data);
+    /* According to M$, the high 4 bits of a FAT32 entry are reserved and
+     * are not part of the cluster number. So we never touch them. */
+    fs->fat[cluster] = (fs->fat[cluster] & 0xf0000000) | (new & 0xfffffff);
+    fs->free_count = -1;
+    /* Removing links keeps simple chains simple; a new link might not */
+    if (new >= 2 && new < fs->clusters + 2 && fs->simple_chain) {
+	free(fs->simple_chain);
+	fs->simple_chain = NULL;
     }
+    if (write_immed)
+	write_fat(fs, cluster, cluster + 1);
+    else
+	fs->fat_dirty[cluster / 64] |= 1ULL << (cluster % 64);
 }
 
 int bad_cluster(DOS_FS * fs, uint32_t cluster)
 {
     FAT_ENTRY curEntry;
-    get_fat(&curEntry, fs->fat, cluster, fs);
+    get_fat(&curEntry, fs->fat, cluster);
 
     return FAT_IS_BAD(fs, curEntry.value);
 }
@@ -256,7 +750,7 @@ uint32_t next_cluster(DOS_FS * fs, uint32_t cluster)
     uint32_t value;
     FAT_ENTRY curEntry;
 
-    get_fat(&curEntry, fs->fat, cluster, fs);
+    get_fat(&curEntry, fs->fat, cluster);
 
     value = curEntry.value;
     if (FAT_IS_BAD(fs, value))
@@ -270,6 +764,70 @@ loff_t cluster_start(DOS_FS * fs, uint32_t cluster)
 			     2) * (uint64_t)fs->cluster_size;
 }
 
+int cluster_extent(DOS_FS * fs, FS_EXTENT * ext, int *n, int max,
+		   uint32_t cluster)
+{
+    loff_t pos = cluster_start(fs, cluster);
+
+    if (*n && ext[*n - 1].pos + ext[*n - 1].size == pos) {
+	ext[*n - 1].size += fs->cluster_size;
+	return 1;
+    }
+    if (*n == max)
+	return 0;
+    ext[*n].pos = pos;
+    ext[(*n)++].size = fs->cluster_size;
+    return 1;
+}
+
+uint32_t extent_cluster(DOS_FS * fs, loff_t pos)
+{
+    return (pos - fs->data_start) / fs->cluster_size + 2;
+}
+
+/**
+ * Get the owner table index of a file, entering the file if needed.
+ *
+ * @param[in,out]   fs          Information about the filesystem
+ * @param[in]	    owner       File that is about to own a cluster
+ *
+ * @return  Index into fs->owners
+ */
+static uint32_t owner_index(DOS_FS * fs, DOS_FILE * owner)
+{
+    uint32_t old_max;
+
+    /* The index may be left over from an earlier pass, so only trust it if
+     * the table still agrees */
+    if (owner->owner_id && owner->owner_id <= fs->n_owners &&
+	fs->owners[owner->owner_id] == owner)
+	return owner->owner_id;
+    if (fs->n_owners + 1 >= fs->max_owners) {
+	old_max = fs->max_owners;
+	fs->max_owners = fs->max_owners ? fs->max_owners * 2 : 256;
+	if (fs->max_owners >= OWNER_PAGE)
+	    die("Too many files");
+	fs->owners = realloc(fs->owners, fs->max_owners * sizeof(DOS_FILE *));
+	if (!fs->owners)
+	    pdie("realloc");
+	fs->owners[0] = NULL;
+	if (stream_scan) {
+	    fs->owner_offset = realloc(fs->owner_offset,
+				       fs->max_owners * sizeof(loff_t));
+	    fs->owner_parent = realloc(fs->owner_parent,
+				       fs->max_owners * sizeof(uint32_t));
+	    fs->owner_stubs = realloc(fs->owner_stubs,
+				      fs->max_owners * sizeof(DOS_FILE *));
+	    if (!fs->owner_offset || !fs->owner_parent || !fs->owner_stubs)
+		pdie("realloc");
+	    memset(fs->owner_stubs + old_max, 0,
+		   (fs->max_owners - old_max) * sizeof(DOS_FILE *));
+	}
+    }
+    fs->owners[++fs->n_owners] = owner;
+    return owner->owner_id = fs->n_owners;
+}
+
 /**
  * Update internal bookkeeping to show that the specified cluster belongs
  * to the specified dentry.
@@ -281,61 +839,311 @@ loff_t cluster_start(DOS_FS * fs, uint32_t cluster)
  */
 void set_owner(DOS_FS * fs, uint32_t cluster, DOS_FILE * owner)
 {
-    if (fs->cluster_owner == NULL)
+    uint32_t span = cluster / 64, id, *page, i;
+    uint64_t bit = 1ULL << (cluster % 64);
+
+    if (fs->owned == NULL)
 	die("Internal error: attempt to set owner in non-existent table");
 
-    if (owner && fs->cluster_owner[cluster]
-	&& (fs->cluster_owner[cluster] != owner))
-	die("Internal error: attempt to change file owner");
-    fs->cluster_owner[cluster] = owner;
+    fs->free_count = -1;
+    if (!owner) {
+	fs->owned[span] &= ~bit;
+	if (!fs->owned[span] && !(fs->span_owner[span] & OWNER_PAGE))
+	    fs->span_owner[span] = 0;
+	return;
+    }
+    id = owner_index(fs, owner);
+    if (fs->owned[span] & bit) {
+	if (get_owner(fs, cluster) != owner)
+	    die("Internal error: attempt to change file owner");
+	return;
+    }
+
+    if (fs->span_owner[span] & OWNER_PAGE)
+	fs->owner_pages[fs->span_owner[span] & ~OWNER_PAGE][cluster % 64] = id;
+    else if (!fs->owned[span] || fs->span_owner[span] == id)
+	fs->span_owner[span] = id;
+    else {
+	/* A second file within this span; give it a page of its own */
+	if (!(fs->n_owner_pages & (fs->n_owner_pages - 1))) {
+	    fs->owner_pages = realloc(fs->owner_pages,
+				      (fs->n_owner_pages ? fs->n_owner_pages *
+				       2 : 1) * sizeof(*fs->owner_pages));
+	    if (!fs->owner_pages)
+		pdie("realloc");
+	}
+	page = fs->owner_pages[fs->n_owner_pages];
+	for (i = 0; i < 64; i++)
+	    page[i] = fs->span_owner[span];
+	page[cluster % 64] = id;
+	fs->span_owner[span] = OWNER_PAGE | fs->n_owner_pages++;
+    }
+    fs->owned[span] |= bit;
+}
+
+/**
+ * Rebuild a released owner from its directory entry on disk, along with
+ * its released parent directories and their long names. Every owner is
+ * rebuilt only once.
+ *
+ * @param[in]   fs      Information about the filesystem
+ * @param[in]   id      Owner table index
+ *
+ * @return      Stand-in allocated from stub_queue, or the owner itself if
+ *              it was not released
+ */
+static DOS_FILE *owner_stub(DOS_FS * fs, uint32_t id)
+{
+    DOS_FILE *file;
+    loff_t bound;
+    char *name;
+
+    if (fs->owners[id])
+	return fs->owners[id];
+    if (fs->owner_stubs[id])
+	return fs->owner_stubs[id];
+    file = fs->owner_stubs[id] = qalloc(&stub_queue, sizeof(DOS_FILE));
+    memset(file, 0, sizeof(DOS_FILE));
+    file->offset = fs->owner_offset[id];
+    fs_read(file->offset, sizeof(DIR_ENT), &file->dir_ent);
+    /* Long names do not cross the cluster of their entry here, as in
+     * drop_dir_tail() */
+    bound = file->offset < fs->data_start ? fs->root_start :
+	cluster_start(fs, (file->offset - fs->data_start) / fs->cluster_size +
+		      2);
+    if ((name = lfn_read(file->offset, bound, &file->lfn_offset))) {
+	file->lfn = qalloc(&stub_queue, strlen(name) + 1);
+	strcpy(file->lfn, name);
+	free(name);
+    }
+    if (fs->owner_parent[id])
+	file->parent = owner_stub(fs, fs->owner_parent[id]);
+    return file;
 }
 
 DOS_FILE *get_owner(DOS_FS * fs, uint32_t cluster)
 {
-    if (fs->cluster_owner == NULL)
+    uint32_t span = cluster / 64, id;
+
+    if (fs->owned == NULL || !(fs->owned[span] & (1ULL << (cluster % 64))))
 	return NULL;
-    else
-	return fs->cluster_owner[cluster];
+    id = fs->span_owner[span];
+    if (id & OWNER_PAGE)
+	id = fs->owner_pages[id & ~OWNER_PAGE][cluster % 64];
+    return owner_stub(fs, id);
 }
 
-void fix_bad(DOS_FS * fs)
+void release_owner(DOS_FS * fs, DOS_FILE * file)
+{
+    DOS_FILE *parent = file->parent;
+    uint32_t id = file->owner_id;
+
+    if (!id || id > fs->n_owners || fs->owners[id] != file)
+	return;
+    fs->owner_offset[id] = file->offset;
+    fs->owner_parent[id] = parent && parent->owner_id &&
+	parent->owner_id <= fs->n_owners &&
+	fs->owners[parent->owner_id] == parent ? parent->owner_id : 0;
+    fs->owners[id] = NULL;
+}
+
+/**
+ * Find out whether the directory entry of an owner, or that of one of its
+ * parent directories, lies in one of the clusters set in a bitmap.
+ *
+ * @param[in]       fs      Information about the filesystem
+ * @param[in]       id      Owner table index
+ * @param[in]       dirs    Bitmap of directory clusters
+ * @param[inout]    memo    Per owner: 0 if unknown, 1 + the answer otherwise
+ *
+ * @return  Non-zero if the entry is in one of the clusters
+ */
+static int entry_in(DOS_FS * fs, uint32_t id, const uint64_t * dirs,
+		    unsigned char *memo)
+{
+    DOS_FILE *file = fs->owners[id];
+    uint32_t parent, cluster;
+    loff_t offset;
+    int in = 0;
+
+    if (memo[id])
+	return memo[id] - 1;
+    if (file) {
+	offset = file->offset;
+	parent = file->parent ? file->parent->owner_id : 0;
+    } else {
+	offset = fs->owner_offset[id];
+	parent = fs->owner_parent[id];
+    }
+    if (offset >= fs->data_start) {
+	cluster = (offset - fs->data_start) / fs->cluster_size + 2;
+	in = dirs[cluster / 64] >> (cluster % 64) & 1;
+    }
+    if (!in && parent && parent != id)
+	in = entry_in(fs, parent, dirs, memo);
+    memo[id] = in + 1;
+    return in;
+}
+
+void disown_entries(DOS_FS * fs, const uint64_t * dirs)
+{
+    unsigned char *memo;
+    uint32_t i, c, id;
+    uint64_t bits;
+
+    memo = talloc(fs->n_owners + 1);
+    memset(memo, 0, fs->n_owners + 1);
+    for (i = 0; i < fs->clusters + 2; i += 64)
+	for (bits = fs->owned[i / 64]; bits; bits &= bits - 1) {
+	    c = i + __builtin_ctzll(bits);
+	    id = fs->span_owner[i / 64];
+	    if (id & OWNER_PAGE)
+		id = fs->owner_pages[id & ~OWNER_PAGE][c % 64];
+	    if (entry_in(fs, id, dirs, memo))
+		set_owner(fs, c, NULL);
+	}
+    tfree(memo);
+}
+
+/**
+ * Find the first free cluster in a range.
+ *
+ * @param[in]   fs      Information about the filesystem
+ * @param[in]   from    First cluster to look at
+ * @param[in]   to      Cluster after the last one to look at
+ *
+ * @return      Cluster number, 0 if there is no free cluster in the range
+ */
+static uint32_t find_free(DOS_FS * fs, uint32_t from, uint32_t to)
 {
     uint32_t i;
+    uint64_t bits;
+    FAT_MASKS m;
+
+    for (i = from & ~63; i < to; i += 64) {
+	fat_masks(fs, i, &m);
+	bits = ~m.used & valid_mask(fs, i);
+	if (fs->owned)
+	    bits &= ~fs->owned[i / 64];
+	if (i < from)
+	    bits &= ~0ULL << (from - i);
+	if (to - i < 64)
+	    bits &= (1ULL << (to - i)) - 1;
+	if (bits)
+	    return i + __builtin_ctzll(bits);
+    }
+    return 0;
+}
+
+uint32_t next_free_cluster(DOS_FS * fs, uint32_t from)
+{
+    uint32_t cluster;
 
+    if (from < 2 || from >= fs->clusters + 2)
+	from = 2;
+    if (!(cluster = find_free(fs, from, fs->clusters + 2)))
+	cluster = find_free(fs, 2, from);
+    return cluster;
+}
+
+void reserve_journal(DOS_FS * fs)
+{
+    uint32_t need, first, end, last = fs->clusters + 2;
+    loff_t size;
+
+    if (!rw || write_immed || !fs->journal_start || !fs->fat ||
+	!(size = fs_undo_size()))
+	return;
+    need = (size + fs->cluster_size - 1) / fs->cluster_size;
+    for (first = find_free(fs, 2, last); first;
+	 first = end < last ? find_free(fs, end + 1, last) : 0) {
+	for (end = first + 1; end - first < need && end < last &&
+	     find_free(fs, end, end + 1); end++) ;
+	if (end - first < need)
+	    continue;
+	/* Free in the FAT now, and not about to change, so free on disk as
+	 * well both before and after the flush */
+	if (fs_pending(fs->fat_start + (loff_t) first * fs->fat_bits / 8,
+		       ((loff_t) need * fs->fat_bits + 7) / 8 + 1) ||
+	    fs_pending(cluster_start(fs, first),
+		       (loff_t) need * fs->cluster_size))
+	    continue;
+	fs_journal(fs->journal_start, cluster_start(fs, first),
+		   (loff_t) need * fs->cluster_size);
+	return;
+    }
     if (verbose)
-	printf("Checking for bad clusters.\n");
-    for (i = 2; i < fs->clusters + 2; i++) {
-	FAT_ENTRY curEntry;
-	get_fat(&curEntry, fs->fat, i, fs);
+	report("No room for an undo journal of %lld bytes.\n",
+	       (long long)size);
+}
+
+/**
+ * fs_scan callback of fix_bad: mark an unreadable cluster bad.
+ */
+static void mark_unreadable(loff_t pos, void *arg)
+{
+    DOS_FS *fs = arg;
+    uint32_t c = extent_cluster(fs, pos);
+
+    report("Cluster %lu is unreadable.\n", (unsigned long)c);
+    set_fat(fs, c, -2);
+}
 
-	if (!get_owner(fs, i) && !FAT_IS_BAD(fs, curEntry.value))
-	    if (!fs_test(cluster_start(fs, i), fs->cluster_size)) {
-		printf("Cluster %lu is unreadable.\n", (unsigned long)i);
-		set_fat(fs, i, -2);
+void fix_bad(DOS_FS * fs)
+{
+    uint32_t i, c;
+    uint64_t bits;
+    FAT_MASKS m;
+    FS_EXTENT *ext;
+    int n = 0;
+
+    if (verbose)
+	report("Checking for bad clusters.\n");
+    /* Runs of free clusters are tested a batch at a time */
+    ext = talloc(SCAN_BATCH * sizeof(FS_EXTENT));
+    for (i = 0; i < fs->clusters + 2; i += 64) {
+	/* Only unowned clusters not yet marked bad need testing */
+	if (!(bits = ~fs->owned[i / 64] & valid_mask(fs, i)))
+	    continue;
+	fat_masks(fs, i, &m);
+	for (bits &= ~m.bad; bits; bits &= bits - 1) {
+	    c = i + __builtin_ctzll(bits);
+	    if (!cluster_extent(fs, ext, &n, SCAN_BATCH, c)) {
+		fs_scan(ext, n, fs->cluster_size, mark_unreadable, fs);
+		n = 0;
+		cluster_extent(fs, ext, &n, SCAN_BATCH, c);
 	    }
+	}
     }
+    fs_scan(ext, n, fs->cluster_size, mark_unreadable, fs);
+    tfree(ext);
 }
 
 void reclaim_free(DOS_FS * fs)
 {
     int reclaimed;
-    uint32_t i;
+    uint32_t i, free = 0;
+    uint64_t owned, bits, valid;
+    FAT_MASKS m;
 
     if (verbose)
-	printf("Checking for unused clusters.\n");
+	report("Checking for unused clusters.\n");
     reclaimed = 0;
-    for (i = 2; i < fs->clusters + 2; i++) {
-	FAT_ENTRY curEntry;
-	get_fat(&curEntry, fs->fat, i, fs);
-
-	if (!get_owner(fs, i) && curEntry.value &&
-	    !FAT_IS_BAD(fs, curEntry.value)) {
-	    set_fat(fs, i, 0);
+    for (i = 0; i < fs->clusters + 2; i += 64) {
+	fat_masks(fs, i, &m);
+	owned = fs->owned[i / 64];
+	valid = valid_mask(fs, i);
+	for (bits = m.used & ~m.bad & ~owned & valid; bits; bits &= bits - 1) {
+	    set_fat(fs, i + __builtin_ctzll(bits), 0);
 	    reclaimed++;
 	}
+	/* Freeing clusters does not change which ones are unowned and not
+	 * bad, so update_free() can reuse this count */
+	free += __builtin_popcountll(~owned & ~m.bad & valid);
     }
+    fs->free_count = free;
     if (reclaimed)
-	printf("Reclaimed %d unused cluster%s (%llu bytes).\n", (int)reclaimed,
+	report("Reclaimed %d unused cluster%s (%llu bytes).\n", (int)reclaimed,
 	       reclaimed == 1 ? "" : "s",
 	       (unsigned long long)reclaimed * fs->cluster_size);
 }
@@ -361,7 +1169,7 @@ static void tag_free(DOS_FS * fs, DOS_FILE * owner, uint32_t *num_refs,
 
     for (i = start_cluster; i < fs->clusters + 2; i++) {
 	FAT_ENTRY curEntry;
-	get_fat(&curEntry, fs->fat, i, fs);
+	get_fat(&curEntry, fs->fat, i);
 
 	/* If the current entry is the head of an un-owned chain... */
 	if (curEntry.value && !FAT_IS_BAD(fs, curEntry.value) &&
@@ -408,10 +1216,11 @@ void reclaim_file(DOS_FS * fs)
     uint32_t total_num_clusters;
 
     if (verbose)
-	printf("Reclaiming unconnected clusters.\n");
+	report("Reclaiming unconnected clusters.\n");
+    memset(&orphan, 0, sizeof(orphan));
 
     total_num_clusters = fs->clusters + 2UL;
-    num_refs = alloc(total_num_clusters * sizeof(uint32_t));
+    num_refs = talloc(total_num_clusters * sizeof(uint32_t));
     memset(num_refs, 0, (total_num_clusters * sizeof(uint32_t)));
 
     /* Guarantee that all orphan chains (except cycles) end cleanly
@@ -420,13 +1229,13 @@ void reclaim_file(DOS_FS * fs)
 
     for (i = 2; i < total_num_clusters; i++) {
 	FAT_ENTRY curEntry;
-	get_fat(&curEntry, fs->fat, i, fs);
+	get_fat(&curEntry, fs->fat, i);
 
 	next = curEntry.value;
 	if (!get_owner(fs, i) && next && next < fs->clusters + 2) {
 	    /* Cluster is linked, but not owned (orphan) */
 	    FAT_ENTRY nextEntry;
-	    get_fat(&nextEntry, fs->fat, next, fs);
+	    get_fat(&nextEntry, fs->fat, next);
 
 	    /* Mark it end-of-chain if it links into an owned cluster,
 	     * a free cluster, or a bad cluster.
@@ -449,7 +1258,7 @@ void reclaim_file(DOS_FS * fs)
 	/* Any unaccounted-for orphans must be part of a cycle */
 	for (i = 2; i < total_num_clusters; i++) {
 	    FAT_ENTRY curEntry;
-	    get_fat(&curEntry, fs->fat, i, fs);
+	    get_fat(&curEntry, fs->fat, i);
 
 	    if (curEntry.value && !FAT_IS_BAD(fs, curEntry.value) &&
 		!get_owner(fs, i)) {
@@ -457,7 +1266,7 @@ void reclaim_file(DOS_FS * fs)
 		    die("Internal error: num_refs going below zero");
 		set_fat(fs, i, -1);
 		changed = curEntry.value;
-		printf("Broke cycle at cluster %lu in free chain.\n", (unsigned long)i);
+		report("Broke cycle at cluster %lu in free chain.\n", (unsigned long)i);
 
 		/* If we've created a new chain head,
 		 * tag_free() can claim it
@@ -489,51 +1298,44 @@ void reclaim_file(DOS_FS * fs)
 	    fs_write(offset, sizeof(DIR_ENT), &de);
 	}
     if (reclaimed)
-	printf("Reclaimed %d unused cluster%s (%llu bytes) in %d chain%s.\n",
+	report("Reclaimed %d unused cluster%s (%llu bytes) in %d chain%s.\n",
 	       reclaimed, reclaimed == 1 ? "" : "s",
 	       (unsigned long long)reclaimed * fs->cluster_size, files,
 	       files == 1 ? "" : "s");
 
-    free(num_refs);
+    tfree(num_refs);
 }
 
 uint32_t update_free(DOS_FS * fs)
 {
-    uint32_t i;
-    uint32_t free = 0;
+    uint32_t free;
     int do_set = 0;
 
-    for (i = 2; i < fs->clusters + 2; i++) {
-	FAT_ENTRY curEntry;
-	get_fat(&curEntry, fs->fat, i, fs);
-
-	if (!get_owner(fs, i) && !FAT_IS_BAD(fs, curEntry.value))
-	    ++free;
-    }
+    free = fs->free_count >= 0 ? fs->free_count : count_free(fs);
 
     if (!fs->fsinfo_start)
 	return free;
 
     if (verbose)
-	printf("Checking free cluster summary.\n");
+	report("Checking free cluster summary.\n");
     if (fs->free_clusters != 0xFFFFFFFF) {
 	if (free != fs->free_clusters) {
-	    printf("Free cluster summary wrong (%ld vs. really %ld)\n",
+	    report("Free cluster summary wrong (%ld vs. really %ld)\n",
 		   (long)fs->free_clusters, (long)free);
 	    if (interactive)
-		printf("1) Correct\n2) Don't correct\n");
+		report("1) Correct\n2) Don't correct\n");
 	    else
-		printf("  Auto-correcting.\n");
+		report("  Auto-correcting.\n");
 	    if (!interactive || get_key("12", "?") == '1')
 		do_set = 1;
 	}
     } else {
-	printf("Free cluster summary uninitialized (should be %ld)\n", (long)free);
+	report("Free cluster summary uninitialized (should be %ld)\n", (long)free);
 	if (rw) {
 	    if (interactive)
-		printf("1) Set it\n2) Leave it uninitialized\n");
+		report("1) Set it\n2) Leave it uninitialized\n");
 	    else
-		printf("  Auto-setting.\n");
+		report("  Auto-setting.\n");
 	    if (!interactive || get_key("12", "?") == '1')
 		do_set = 1;
 	}
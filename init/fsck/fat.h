@@ -23,20 +23,42 @@
 #ifndef _FAT_H
 #define _FAT_H
 
+#include "io.h"
+
 void read_fat(DOS_FS * fs);
 
 /* Loads the FAT of the filesystem described by FS. Initializes the FAT,
    replaces broken FATs and rejects invalid cluster entries. */
 
-void get_fat(FAT_ENTRY * entry, void *fat, uint32_t cluster, DOS_FS * fs);
+void free_fat(DOS_FS * fs);
+
+/* Deallocates everything read_fat set up. Changes not flushed with flush_fat
+   are lost. */
+
+static inline void get_fat(FAT_ENTRY * entry, const uint32_t * fat,
+			   uint32_t cluster)
+{
+    /* According to M$, the high 4 bits of a FAT32 entry are reserved and
+     * are not part of the cluster number. So we cut them off. FAT12/16
+     * entries never have these bits set. */
+    entry->value = fat[cluster] & 0xfffffff;
+    entry->reserved = fat[cluster] >> 28;
+}
 
-/* Retrieve the FAT entry (next chained cluster) for CLUSTER. */
+/* Retrieve the FAT entry (next chained cluster) for CLUSTER from the decoded
+   FAT FAT, which is normally FS->fat. */
 
 void set_fat(DOS_FS * fs, uint32_t cluster, int32_t new);
 
 /* Changes the value of the CLUSTERth cluster of the FAT of FS to NEW. Special
    values of NEW are -1 (EOF, 0xff8 or 0xfff8) and -2 (bad sector, 0xff7 or
-   0xfff7) */
+   0xfff7). Unless write_immed is set, the change is only recorded in the
+   decoded FAT until flush_fat is called. */
+
+void flush_fat(DOS_FS * fs);
+
+/* Encodes all FAT entries changed by set_fat since the last call and writes
+   them to every copy of the FAT with fs_write. */
 
 int bad_cluster(DOS_FS * fs, uint32_t cluster);
 
@@ -53,6 +75,17 @@ loff_t cluster_start(DOS_FS * fs, uint32_t cluster);
 
 /* Returns the byte offset of CLUSTER, relative to the respective device. */
 
+int cluster_extent(DOS_FS * fs, FS_EXTENT * ext, int *n, int max,
+		   uint32_t cluster);
+
+/* Adds CLUSTER to the N extents EXT for fs_scan, growing the last one if
+   CLUSTER directly follows it. Returns zero if CLUSTER needs an extent of its
+   own but there are MAX already, non-zero otherwise. */
+
+uint32_t extent_cluster(DOS_FS * fs, loff_t pos);
+
+/* Returns the number of the cluster at byte offset POS. */
+
 void set_owner(DOS_FS * fs, uint32_t cluster, DOS_FILE * owner);
 
 /* Sets the owner pointer of the respective cluster to OWNER. If OWNER was NULL
@@ -62,7 +95,56 @@ void set_owner(DOS_FS * fs, uint32_t cluster, DOS_FILE * owner);
 DOS_FILE *get_owner(DOS_FS * fs, uint32_t cluster);
 
 /* Returns the owner of the repective cluster or NULL if the cluster has no
-   owner. */
+   owner. If the owner was released, a stand-in read from its directory entry
+   is returned; it has no long name. The same stand-in is returned for every
+   cluster of that owner, so it can be compared with other owners and
+   changed with MODIFY like any other entry. It stays valid until free_fat,
+   as do the stand-ins of its parent directories. */
+
+void release_owner(DOS_FS * fs, DOS_FILE * file);
+
+/* Records where the directory entry of FILE is, so that the clusters it owns
+   remain owned after the DOS_FILE itself has been deallocated. */
+
+void scan_chains(DOS_FS * fs);
+
+/* Computes the in-degree of every cluster in one pass over the FAT and from
+   it finds the chain heads whose chains are simple: no cluster on the chain
+   is shared with another chain or part of a loop, and none is bad. The
+   summary stays valid until set_fat adds a link. */
+
+int chain_is_simple(DOS_FS * fs, uint32_t start);
+
+/* Returns a non-zero integer if the chain starting at cluster START is known
+   to be simple, as determined by scan_chains. Returns zero if it is not, or
+   if that is unknown. */
+
+uint32_t claim_chain(DOS_FS * fs, uint32_t start, uint32_t max,
+		     DOS_FILE * owner);
+
+/* Makes OWNER the owner of every cluster of the simple chain starting at
+   START, if none of them has an owner yet and there are at most MAX of
+   them. Returns the number of clusters, or zero, with nothing changed, if
+   the chain has to be walked cluster by cluster instead. */
+
+void disown_entries(DOS_FS * fs, const uint64_t * dirs);
+
+/* Releases the clusters of every file whose directory entry, or the entry of
+   one of its parent directories, lies in a cluster set in the bitmap DIRS.
+   Used when a directory loses clusters after its entries were scanned. */
+
+uint32_t next_free_cluster(DOS_FS * fs, uint32_t from);
+
+/* Returns the first cluster at or after FROM, wrapping around at the end of
+   the filesystem, that is neither in use in the FAT nor owned by a file, or
+   zero if there is none. */
+
+void reserve_journal(DOS_FS * fs);
+
+/* Finds a run of clusters that is free on disk and stays free after the
+   pending changes are flushed, large enough for the undo journal of the
+   flush, and passes it to fs_journal. Does nothing if the filesystem is not
+   written to or has no room for the journal header. */
 
 void fix_bad(DOS_FS * fs);
 
@@ -42,7 +42,7 @@
 #include "file.h"
 #include "charconv.h"
 
-FDSC *fp_root = NULL;
+__thread FDSC *fp_root = NULL;
 
 static void put_char(char **p, unsigned char c)
 {
@@ -68,7 +68,7 @@ static void put_char(char **p, unsigned char c)
  */
 char *file_name(unsigned char *fixed)
 {
-    static char path[MSDOS_NAME * 4 + 2];
+    static __thread char path[MSDOS_NAME * 4 + 2];
     char *p;
     int i, j;
 
@@ -102,13 +102,13 @@ int file_cvt(unsigned char *name, unsigned char *fixed)
     while (*name) {
 	c = *name;
 	if (c < ' ' || c > 0x7e || strchr("*?<>|\"/", c)) {
-	    printf("Invalid character in name. Use \\ooo for special "
+	    report("Invalid character in name. Use \\ooo for special "
 		   "characters.\n");
 	    return 0;
 	}
 	if (c == '.') {
 	    if (ext) {
-		printf("Duplicate dots in name.\n");
+		report("Duplicate dots in name.\n");
 		return 0;
 	    }
 	    while (size--)
@@ -122,13 +122,13 @@ int file_cvt(unsigned char *name, unsigned char *fixed)
 	    c = 0;
 	    for (cnt = 3; cnt; cnt--) {
 		if (*name < '0' || *name > '7') {
-		    printf("Invalid octal character.\n");
+		    report("Invalid octal character.\n");
 		    return 0;
 		}
 		c = c * 8 + *name++ - '0';
 	    }
 	    if (cnt < 4) {
-		printf("Expected three octal digits.\n");
+		report("Expected three octal digits.\n");
 		return 0;
 	    }
 	    name += 3;
@@ -249,12 +249,12 @@ void file_modify(FDSC ** curr, char *fixed)
 	die("Internal error: file_find failed");
     switch ((*this)->type) {
     case fdt_drop:
-	printf("Dropping %s\n", file_name((unsigned char *)fixed));
+	report("Dropping %s\n", file_name((unsigned char *)fixed));
 	*(unsigned char *)fixed = DELETED_FLAG;
 	break;
     case fdt_undelete:
 	*fixed = *(*this)->name;
-	printf("Undeleting %s\n", file_name((unsigned char *)fixed));
+	report("Undeleting %s\n", file_name((unsigned char *)fixed));
 	break;
     default:
 	die("Internal error: file_modify");
@@ -273,7 +273,7 @@ static void report_unused(FDSC * this)
 	if (this->first)
 	    report_unused(this->first);
 	else if (this->type != fdt_none)
-	    printf("Warning: did not %s file %s\n", this->type == fdt_drop ?
+	    report("Warning: did not %s file %s\n", this->type == fdt_drop ?
 		   "drop" : "undelete", file_name((unsigned char *)this->name));
 	free(this);
 	this = next;
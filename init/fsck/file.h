@@ -32,7 +32,7 @@ typedef struct _fptr {
     struct _fptr *next;		/* next file in directory */
 } FDSC;
 
-extern FDSC *fp_root;
+extern __thread FDSC *fp_root;
 
 char *file_name(unsigned char *fixed);
 
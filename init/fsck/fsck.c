@@ -1,5 +1,10 @@
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include <mntent.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 
 #include "common.h"
 #include "fsck.fat.h"
@@ -8,60 +13,371 @@
 #include "fat.h"
 #include "file.h"
 #include "check.h"
+#include "lfn.h"
 #include "charconv.h"
+#include "fsck.h"
 
-int interactive = 0, rw = 1, list = 0, test = 0, verbose = 1, write_immed = 0;
-int atari_format = 0, boot_only = 0;
-unsigned n_files = 0;
-void *mem_queue = NULL;
+// Set from the fsck_ctx_t of the check running on the thread
+__thread int interactive = 0, rw = 1, list = 0, test = 0, verbose = 1;
+__thread int write_immed = 0, atari_format = 0, boot_only = 0;
+__thread int mmap_io = 0;
+__thread int scan_threads = 0;
+__thread int stream_scan = 0;
+__thread int fast_check = 0;
+__thread int check_budget = 0;
+__thread unsigned n_files = 0;
+__thread void *mem_queue = NULL;
 
-int
-fsck(const char *dev)
+// Wall time spent in each phase of the check, in microseconds
+static __thread struct {
+  unsigned long long open, read_boot, read_fat, scan_root, reclaim;
+  unsigned long long update_free, close;
+} phase_us;
+
+
+/**
+ * Returns the time since *t and moves *t to now
+ */
+static unsigned long long
+lap(unsigned long long *t)
 {
-  DOS_FS fs;
+  unsigned long long now = monotime_usec(), d = now - *t;
+  *t = now;
+  return d;
+}
 
+static int
+check(fsck_ctx_t *ctx, DOS_FS *fs)
+{
+  const char *dev = ctx->dev;
   const int verify = 0;
   const int salvage_files = 0;
   uint32_t free_clusters;
+  int changed, replayed;
+  unsigned long long start = monotime_usec(), t = start;
 
-  memset(&fs, 0, sizeof(fs));
+  memset(&phase_us, 0, sizeof(phase_us));
+  memset(&qstats, 0, sizeof(qstats));
+  n_files = 0;
 
   fs_open((char *)dev, rw);
+  // A flush cut short by a power loss is undone before anything is looked
+  // at, and the check it was part of is then made again in full; so is one
+  // whose journal was torn and can't be undone
+  replayed = replay_journal();
+  phase_us.open = lap(&t);
+
+  read_boot(fs);
+  phase_us.read_boot = lap(&t);
+
+  // read_boot() may have repaired the boot sector already
+  changed = fs_changed();
+  if (fast_check && !test && !replayed && check_stamp(fs)) {
+    ctx->skipped = 1;
+    if (!boot_only)
+      summary("%s: unchanged since full check %u, skipping it\n", dev,
+              fs->generation);
+    fs_close(rw);
+    phase_us.close = lap(&t);
+    return changed;
+  }
 
-  read_boot(&fs);
+  // A volume marked dirty gets a full check however long it takes
+  if (check_budget && !fs->was_dirty)
+    fs->deadline = start + check_budget * 1000ULL;
 
   if (verify)
-    printf("Starting check/repair pass.\n");
-  while (read_fat(&fs), scan_root(&fs))
+    report("Starting check/repair pass.\n");
+  read_fat(fs);
+  phase_us.read_fat = lap(&t);
+  scan_root(fs);
+  phase_us.scan_root = lap(&t);
+  if (fs->incomplete) {
+    // What was repaired so far is what a full check would have repaired
+    // first, but unowned clusters can't be told apart from the ones of the
+    // files not looked at
+    if (!boot_only)
+      summary("%s: out of time after %u files, rest of the tree unchecked\n",
+              dev, n_files);
     qfree(&mem_queue);
+    flush_fat(fs);
+    reserve_journal(fs);
+    fs_close(rw);
+    phase_us.close = lap(&t);
+    return FSCK_INCOMPLETE;
+  }
   if (test)
-    fix_bad(&fs);
+    fix_bad(fs);
   if (salvage_files)
-    reclaim_file(&fs);
+    reclaim_file(fs);
   else
-    reclaim_free(&fs);
-  free_clusters = update_free(&fs);
+    reclaim_free(fs);
+  phase_us.reclaim = lap(&t);
+  free_clusters = update_free(fs);
+  phase_us.update_free = lap(&t);
   file_unused();
   qfree(&mem_queue);
   if (verify) {
     n_files = 0;
-    printf("Starting verification pass.\n");
-    read_fat(&fs);
-    scan_root(&fs);
-    reclaim_free(&fs);
+    report("Starting verification pass.\n");
+    read_fat(fs);
+    phase_us.read_fat += lap(&t);
+    scan_root(fs);
+    phase_us.scan_root += lap(&t);
+    reclaim_free(fs);
+    phase_us.reclaim += lap(&t);
     qfree(&mem_queue);
   }
 
+  flush_fat(fs);
   if (fs_changed()) {
     if (rw) {
-      printf("Performing changes.\n");
+      report("Performing changes.\n");
     } else
-      printf("Leaving filesystem unchanged.\n");
+      report("Leaving filesystem unchanged.\n");
   }
 
   if (!boot_only)
-    printf("%s: %u files, %lu/%lu clusters\n", dev,
-           n_files, (unsigned long)fs.clusters - free_clusters, (unsigned long)fs.clusters);
+    summary("%s: %u files, %lu/%lu clusters\n", dev,
+            n_files, (unsigned long)fs->clusters - free_clusters, (unsigned long)fs->clusters);
+
+  if (verbose) {
+    struct rusage ru;
+    if (!getrusage(RUSAGE_THREAD, &ru))
+      report("Peak memory use: %ld KiB\n", ru.ru_maxrss);
+    report("Tree memory: %lu allocation%s, %lu KiB (%lu KiB at most at once) "
+           "in %lu chunk%s, released in %lu us\n", qstats.allocs,
+           qstats.allocs == 1 ? "" : "s", (qstats.bytes + 1023) / 1024,
+           (qstats.peak + 1023) / 1024, qstats.chunks,
+           qstats.chunks == 1 ? "" : "s", qstats.free_usec);
+  }
+
+  // The stamp is not a repair, so it must not affect the return value
+  changed = fs_changed();
+  if (fast_check && rw)
+    write_stamp(fs);
+  reserve_journal(fs);
+  fs_close(rw);
+  phase_us.close = lap(&t);
+  return changed ? 1 : 0;
+}
+
+
+/**
+ * Returns non-zero if 'dev' is mounted read-write, or if that can't be told
+ */
+static int
+mounted_rw(const char *dev)
+{
+  struct stat st, mst;
+  struct mntent m;
+  char buf[1024];
+  int r = 0;
 
-  return fs_close(rw) ? 1 : 0;
+  FILE *fp = setmntent("/proc/self/mounts", "r");
+  if(fp == NULL)
+    return 1;
+  int blk = !stat(dev, &st) && S_ISBLK(st.st_mode);
+  while(getmntent_r(fp, &m, buf, sizeof(buf)) != NULL) {
+    if(blk ? stat(m.mnt_fsname, &mst) || !S_ISBLK(mst.st_mode) ||
+       mst.st_rdev != st.st_rdev : strcmp(m.mnt_fsname, dev))
+      continue;
+    if(hasmntopt(&m, "rw"))
+      r = 1;
+  }
+  endmntent(fp);
+  return r;
+}
+
+
+/**
+ * The volume is in use, so only leave a note for the next boot. The vfat
+ * driver rewrites the boot sector itself while the volume is mounted
+ * read-write, so it is only touched while it is mounted read-only, if at
+ * all.
+ */
+static int
+mark_dirty(fsck_ctx_t *ctx, DOS_FS *fs)
+{
+  (void)fs; // Only the boot sector is touched, nothing needs to be read
+  if(mounted_rw(ctx->dev))
+    die("%s needs repair, but is mounted read-write", ctx->dev);
+  summary("%s: needs repair, marking it dirty\n", ctx->dev);
+  fs_open((char *)ctx->dev, 1);
+  set_dirty_bit();
+  fs_close(1);
+  return 1;
+}
+
+
+/**
+ * Run 'fn' on a fresh DOS_FS with die() and pdie() returning FSCK_ERROR
+ * from here, and release whatever it left behind either way
+ */
+static int
+guarded(fsck_ctx_t *ctx, int (*fn)(fsck_ctx_t *ctx, DOS_FS *fs))
+{
+  // On the heap, as locals changed after setjmp() are lost by longjmp()
+  DOS_FS *fs = calloc(1, sizeof(DOS_FS));
+  jmp_buf env;
+  int r;
+
+  if(fs == NULL) {
+    snprintf(ctx->error, sizeof(ctx->error), "Out of memory");
+    return FSCK_ERROR;
+  }
+
+  if(setjmp(env)) {
+    fs_abort();
+    qfree(&mem_queue);
+    lfn_reset();
+    r = FSCK_ERROR;
+  } else {
+    die_catch(&env, ctx->error, sizeof(ctx->error));
+    r = fn(ctx, fs);
+  }
+  die_catch(NULL, NULL, 0);
+
+  scan_release();
+  free_fat(fs);
+  free(fs->label);
+  free(fs);
+  close_conversion();
+  // The temporaries of whatever die() interrupted, after fs_abort() has
+  // waited for the I/O into them
+  tfree_all();
+  return r;
+}
+
+
+/**
+ * Apply the settings of 'ctx' to the calling thread
+ */
+static void
+begin(fsck_ctx_t *ctx)
+{
+  interactive = ctx->interactive;
+  rw = ctx->rw;
+  list = ctx->list;
+  test = ctx->test;
+  verbose = ctx->verbose;
+  write_immed = ctx->write_immed;
+  atari_format = ctx->atari_format;
+  boot_only = ctx->boot_only;
+  mmap_io = ctx->mmap_io;
+  scan_threads = ctx->scan_threads;
+  stream_scan = ctx->stream_scan;
+  fast_check = ctx->fast_check;
+  check_budget = ctx->check_budget;
+  ctx->error[0] = 0;
+  ctx->skipped = 0;
+
+  // Prompts have to be seen as they are made
+  if(ctx->collect_report && !interactive) {
+    if(ctx->report == NULL)
+      ctx->report = calloc(1, sizeof(REPORT));
+    report_collect(ctx->report);
+  }
+}
+
+
+/**
+ * Fill in ctx->stats for a check that started at 'start' and returned 'r'
+ */
+static void
+record_stats(fsck_ctx_t *ctx, int r, unsigned long long start)
+{
+  unsigned long long total = monotime_usec() - start;
+  struct rusage ru;
+
+  // Linux has no peak RSS per thread; ru_maxrss is the process's even here,
+  // but the CPU time is that of this check alone
+  if(getrusage(RUSAGE_THREAD, &ru))
+    memset(&ru, 0, sizeof(ru));
+
+  snprintf(ctx->stats, sizeof(ctx->stats),
+           "dev=%s result=%d files=%u "
+           "open_us=%llu read_boot_us=%llu read_fat_us=%llu "
+           "scan_root_us=%llu reclaim_us=%llu update_free_us=%llu "
+           "close_us=%llu total_us=%llu "
+           "read_bytes=%llu reads=%lu write_bytes=%llu writes=%lu "
+           "syscalls=%lu seeks=%lu mmap=%d peak_changes=%d "
+           "cpu_us=%llu peak_rss_kib=%ld tree_peak_kib=%lu",
+           ctx->dev, r, n_files,
+           phase_us.open, phase_us.read_boot, phase_us.read_fat,
+           phase_us.scan_root, phase_us.reclaim, phase_us.update_free,
+           phase_us.close, total,
+           io_stats.read_bytes, io_stats.reads,
+           io_stats.write_bytes, io_stats.writes,
+           io_stats.syscalls, io_stats.seeks, mmap_io,
+           io_stats.peak_changes,
+           (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000ULL +
+           ru.ru_utime.tv_usec + ru.ru_stime.tv_usec,
+           (long)ru.ru_maxrss, (unsigned long)(qstats.peak + 1023) / 1024);
+}
+
+
+/**
+ *
+ */
+void
+fsck_init(fsck_ctx_t *ctx, const char *dev)
+{
+  memset(ctx, 0, sizeof(fsck_ctx_t));
+  ctx->dev = dev;
+  ctx->rw = 1;
+  ctx->verbose = 1;
+}
+
+
+/**
+ *
+ */
+int
+fsck_run(fsck_ctx_t *ctx)
+{
+  unsigned long long start = monotime_usec();
+  int r;
+
+  begin(ctx);
+  r = guarded(ctx, check);
+  record_stats(ctx, r, start);
+  report_collect(NULL);
+  return r;
+}
+
+
+/**
+ *
+ */
+int
+fsck_verify(fsck_ctx_t *ctx)
+{
+  unsigned long long start = monotime_usec();
+  int r;
+
+  begin(ctx);
+  rw = 0;
+  check_budget = 0;
+  fast_check = 0;
+  r = guarded(ctx, check);
+  record_stats(ctx, r, start);
+  if(r == 1 && guarded(ctx, mark_dirty) == FSCK_ERROR)
+    r = FSCK_ERROR;
+  report_collect(NULL);
+  return r;
+}
+
+
+/**
+ *
+ */
+void
+fsck_report(fsck_ctx_t *ctx, void (*line)(const char *text))
+{
+  if(ctx->report == NULL)
+    return;
+  report_drain(ctx->report, line);
+  free(ctx->report);
+  ctx->report = NULL;
 }
@@ -117,7 +117,8 @@ struct boot_sector_16 {
 
 struct info_sector {
     __u32 magic;		/* Magic for info sector ('RRaA') */
-    __u8 junk[0x1dc];
+    __u8 junk[0x1dc];		/* FSI_Reserved1, unused by the spec; holds the
+				   check stamp, see boot.c */
     __u32 reserved1;		/* Nothing as far as I can tell */
     __u32 signature;		/* 0x61417272 ('rrAa') */
     __u32 free_clusters;	/* Free cluster count.  -1 if unknown */
@@ -148,6 +149,7 @@ typedef struct _dos_file {
     struct _dos_file *parent;	/* parent directory */
     struct _dos_file *next;	/* next entry */
     struct _dos_file *first;	/* first entry (directory only) */
+    uint32_t owner_id;		/* index in the owner table, see set_owner */
 } DOS_FILE;
 
 typedef struct {
@@ -170,15 +172,49 @@ typedef struct {
     loff_t fsinfo_start;	/* 0 if not present */
     long free_clusters;
     loff_t backupboot_start;	/* 0 if not present */
-    unsigned char *fat;
-    DOS_FILE **cluster_owner;
+    loff_t stamp_start;		/* 0 if there is no room for a check stamp */
+    loff_t journal_start;	/* of the undo journal header, 0 if none */
+    uint32_t generation;	/* of the last full check, see check_stamp */
+    int was_dirty;		/* the dirty bit was set in the boot sector */
+    unsigned long long deadline;	/* monotime_usec() at which scan_root
+					   stops, 0 for none */
+    int incomplete;		/* scan_root stopped at the deadline */
+    uint32_t *fat;		/* decoded FAT, one entry per cluster */
+    uint64_t *fat_dirty;	/* bitmap of entries changed since flush_fat */
+    /* Cluster ownership: a bit per cluster, plus one word per span of 64
+     * clusters that is either the owner table index shared by all owned
+     * clusters of the span, or OWNER_PAGE | index of a page that holds one
+     * owner index per cluster. */
+    uint64_t *owned;
+    uint32_t *span_owner;
+    uint32_t (*owner_pages)[64];
+    uint32_t n_owner_pages;
+    DOS_FILE **owners;		/* owner table, entry 0 is unused */
+    uint32_t n_owners, max_owners;
+    /* With stream_scan, the directory entry offset and the parent's owner
+     * table index of every owner, for entries that release_owner dropped
+     * from the table (their owners entry is NULL then) */
+    loff_t *owner_offset;
+    uint32_t *owner_parent;
+    DOS_FILE **owner_stubs;	/* get_owner's stand-ins for those, or NULL */
+    long free_count;		/* unowned, not bad clusters; -1 if unknown */
+    /* Chain summary from scan_chains, NULL when not (or no longer) valid:
+     * a bit per cluster set if the chain starting there is simple */
+    uint64_t *simple_chain;
     char *label;
 } DOS_FS;
 
-extern int interactive, rw, list, verbose, test, write_immed;
-extern int atari_format;
-extern unsigned n_files;
-extern void *mem_queue;
+/* Settings and state of the check running on the calling thread, see
+ * fsck_run() */
+extern __thread int interactive, rw, list, verbose, test, write_immed;
+extern __thread int mmap_io;
+extern __thread int scan_threads;
+extern __thread int stream_scan;
+extern __thread int fast_check;
+extern __thread int check_budget;
+extern __thread int atari_format;
+extern __thread unsigned n_files;
+extern __thread void *mem_queue;
 
 /* value to use as end-of-file marker */
 #define FAT_EOF(fs)	((atari_format ? 0xfff : 0xff8) | FAT_EXTD(fs))
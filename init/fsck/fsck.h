@@ -0,0 +1,114 @@
+#pragma once
+
+#define FSCK_ERROR      -1
+#define FSCK_INCOMPLETE 2
+
+/**
+ * One check of one volume. Checks on different threads don't share any
+ * state, so several volumes can be checked at once, each on its own thread.
+ */
+typedef struct fsck_ctx {
+  // Settings, see fsck_init() for the defaults
+
+  const char *dev;       // Device or image to check
+  int rw;                // Write repairs to the volume
+  int interactive;       // Ask before each repair
+  int verbose;
+  int list;              // List every file as it is checked
+  int test;              // Test clusters for bad sectors
+  int write_immed;       // Write each repair right away instead of at the end
+  int atari_format;
+  int boot_only;         // Only check the boot sector
+
+  /**
+   * Map the whole volume instead of reading it
+   */
+  int mmap_io;
+
+  /**
+   * Number of threads reading directories ahead of the check, 0 for none.
+   * They only read; parsing and repairs stay on the thread running the check.
+   * Not used when the reads can be kept in flight with io_uring instead
+   */
+  int scan_threads;
+
+  /**
+   * Release checked subtrees as the walk goes, keeping memory bounded
+   */
+  int stream_scan;
+
+  /**
+   * If non-zero, skip the full check when the volume is clean and unchanged
+   * since the last one. A skipped check writes nothing to the volume, so
+   * walking the whole tree every so often regardless is up to the caller,
+   * see 'skipped'
+   */
+  int fast_check;
+
+  /**
+   * If non-zero, the number of milliseconds fsck_run() may take. The boot
+   * sector, the FATs and the root directory with the files in it are always
+   * checked; subdirectories only while time remains. Volumes marked dirty
+   * are always checked in full.
+   */
+  int check_budget;
+
+  /**
+   * Keep what the check has to say in memory for fsck_report() instead of
+   * printing it, except for a one-line summary per check. Ignored in
+   * interactive mode.
+   */
+  int collect_report;
+
+  // Results
+
+  /**
+   * Why the check failed, if it returned FSCK_ERROR
+   */
+  char error[256];
+
+  /**
+   * The full check was skipped, see fast_check
+   */
+  int skipped;
+
+  /**
+   * One line record of the check: wall time per phase, I/O counters, the
+   * most changes pending at once, the CPU time of the check and peak memory
+   * use, of the process and of the directory tree of the check, as space
+   * separated key=value pairs
+   */
+  char stats[640];
+
+  struct report *report;  // Collected messages, see fsck_report()
+} fsck_ctx_t;
+
+/**
+ * Clear 'ctx' and set it up for checking and repairing 'dev', which must
+ * stay valid as long as 'ctx' is used
+ */
+void fsck_init(fsck_ctx_t *ctx, const char *dev);
+
+/**
+ * Check and repair the FAT filesystem described by 'ctx' on the calling
+ * thread. Returns 1 if the filesystem was changed, 0 otherwise,
+ * FSCK_INCOMPLETE if check_budget ran out before all of it was checked, or
+ * FSCK_ERROR if it could not be checked at all. Repairs made before such an
+ * error are not written.
+ */
+int fsck_run(fsck_ctx_t *ctx);
+
+/**
+ * Check ctx->dev in full without changing it, for a volume that is in use.
+ * If it needs repairs, its dirty bit is set so that the next fsck_run() is a
+ * full one. Returns 1 in that case, 0 if not, or FSCK_ERROR. The dirty bit
+ * is only set while the volume is mounted read-only or not at all; if it
+ * needs repairs while mounted read-write, FSCK_ERROR is returned.
+ */
+int fsck_verify(fsck_ctx_t *ctx);
+
+/**
+ * Hand every line collected with collect_report set to 'line', oldest
+ * first, and forget them
+ */
+void fsck_report(fsck_ctx_t *ctx, void (*line)(const char *text));
@@ -38,24 +38,208 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 
 #include "fsck.fat.h"
 #include "common.h"
 #include "io.h"
+#include "ioqueue.h"
+
+/* Pending changes are kept in an array sorted by offset. Overlapping and
+ * adjacent writes are merged as they are queued, so the entries never touch
+ * each other and their end offsets are strictly increasing. This lets
+ * fs_read() and fs_write() locate the affected entries by binary search
+ * instead of walking every queued change. */
 
 typedef struct _change {
-    void *data;
+    void *data;			/* NULL if the data is in the mapping */
     loff_t pos;
     int size;
-    struct _change *next;
+    int alloc;			/* bytes allocated for data */
 } CHANGE;
 
-static CHANGE *changes, *last;
-static int fd, did_change = 0;
+static __thread CHANGE *changes;
+static __thread int n_changes, max_changes;
+static __thread int fd = -1, did_change = 0;
+static __thread const char *dev_path;	/* as passed to fs_open() */
+static __thread int scan_fd = -1;	/* fs_scan() descriptor, see scan_open() */
+static __thread int n_queued;		/* fs_write() calls that were queued */
+static __thread int async_io;		/* requests really run concurrently */
+
+/* I/O counters since fs_open(). A request counts as a seek if it does not
+ * start where the previous one ended. The prefetch workers keep their own
+ * counts under the pool lock, which prefetch_stop() adds in. */
+__thread IO_STATS io_stats;
+static __thread loff_t io_next;
+
+/* With mmap_io the whole device is mapped privately. fs_write() stores into
+ * the mapping, so it always reflects the pending changes (only their ranges
+ * are kept in the change index) and the device is untouched until fs_flush()
+ * writes those ranges back. */
+static __thread char *map;
+static __thread loff_t map_size;
+
+/* Regions registered with fs_mirror(). Writes to the region are only kept
+ * once in the change index and repeated at the copy when flushed; fs_read()
+ * of the copy applies them on the fly. */
+#define MAX_MIRRORS	4
+
+typedef struct {
+    loff_t pos;
+    loff_t size;
+    loff_t copy;
+} MIRROR;
+
+static __thread MIRROR mirrors[MAX_MIRRORS];
+static __thread int n_mirrors;
+
+/* fs_flush() writes whole FLUSH_BLOCK units, filling the gaps between
+ * changes with the data that is already on disk, so the card never has to
+ * do a read-modify-write of a partially written page. Runs are not allowed
+ * to cross a FLUSH_ERASE boundary. */
+#define FLUSH_BLOCK	4096
+#define FLUSH_ERASE	(4 * 1024 * 1024)
+
+/* Runs are read and written in batches of up to FLUSH_BATCH bytes, so that
+ * several of them can be in flight at once without holding an unbounded
+ * amount of gap data in memory. */
+#define FLUSH_BATCH	(8 * 1024 * 1024)
+
+/* Undo journal, see fs_journal(). The header points to a run of records,
+ * each a JOURNAL_REC followed by the original contents of a range that
+ * fs_flush() is about to overwrite. The header is only written once all of
+ * the records are on disk, and cleared once the flush is. */
+#define JOURNAL_MAGIC	0x4f444e55	/* "UNDO" */
+#define JOURNAL_MAX	(64 * 1024 * 1024)
+
+typedef struct {
+    __u32 magic;
+    __u32 size;			/* bytes of records */
+    __u64 pos;			/* where the records are */
+    __u32 data_sum;		/* journal_sum() of the records */
+    __u32 sum;			/* journal_sum() of all of the above */
+} __attribute__ ((packed)) JOURNAL_HEAD;
+
+typedef struct {
+    __u64 pos;
+    __u32 size;			/* bytes of data that follow */
+    __u32 unused;
+} __attribute__ ((packed)) JOURNAL_REC;
+
+static __thread loff_t journal_head;	/* 0 if there is no journal */
+static __thread loff_t journal_pos, journal_size;
+
+/* fs_scan() reads SCAN_CHUNK bytes per request into buffers aligned for
+ * O_DIRECT. With io_uring, up to SCAN_DEPTH of them are in flight; the
+ * synchronous ioqueue backend performs each one as it is submitted. */
+#define SCAN_CHUNK	(512 * 1024)
+#define SCAN_DEPTH	8
+#define SCAN_ALIGN	4096
+
+typedef struct {
+    int unit;
+    int depth;			/* buffers, at most SCAN_DEPTH */
+    char *mem;			/* holds the buffers */
+    char *buf[SCAN_DEPTH];
+    IOQ_REQ req[SCAN_DEPTH];
+    struct iovec iov[SCAN_DEPTH];
+    void (*bad) (loff_t pos, void *arg);
+    void *arg;
+} SCAN;
+
+/* Small LRU cache of extents loaded with fs_cache(), typically whole
+ * directory clusters. Slots hold the data as it is on disk; pending changes
+ * are applied on top by fs_read() exactly as for uncached reads, so the
+ * cache never needs to know about the change index. */
+#define CACHE_SLOTS	8
+
+typedef struct {
+    loff_t pos;
+    int size;			/* 0 if the slot is unused */
+    int alloc;
+    unsigned lru;
+    char *data;
+    int pending;		/* read ahead request still in flight */
+    IOQ_REQ req;
+    struct iovec iov;
+} CACHE_SLOT;
+
+static __thread CACHE_SLOT cache[CACHE_SLOTS];
+static __thread unsigned cache_clock;
+
+/* With scan_threads set and no io_uring, ranges passed to fs_read_ahead()
+ * are read by a pool of worker threads, several at a time, while the main
+ * thread goes on parsing. With io_uring, the ring keeps them in flight
+ * instead and no workers are started. Only the reads are offloaded: parsing needs the LFN state, the
+ * cluster owners and the change list, which are all private to the thread
+ * running the check. Workers only ever pread() into the buffer of the slot
+ * they took; fs_cache() hands a finished slot over to the cache, so pending
+ * changes are applied on the main thread exactly as for data it read itself
+ * and the result never depends on how the workers were scheduled. */
+#define PREFETCH_SLOTS	64
+#define MAX_SCAN_THREADS 8
+
+enum { PF_FREE, PF_QUEUED, PF_BUSY, PF_DONE };
+
+typedef struct {
+    loff_t pos;
+    int size;
+    int state;
+    unsigned seq;		/* queued slots are read in this order */
+    ssize_t res;		/* bytes read or -errno, once PF_DONE */
+    char *data;
+} PREFETCH;
+
+/* Everything the workers share with the thread running the check. That
+ * thread's instance is handed to them, as they have their own copy of the
+ * thread-local state of this file. */
+typedef struct {
+    PREFETCH slot[PREFETCH_SLOTS];
+    unsigned seq;
+    pthread_t workers[MAX_SCAN_THREADS];
+    int n_workers, stop;
+    int active;			/* lock and conditions are initialized */
+    int fd;
+    pthread_mutex_t lock;
+    pthread_cond_t work, done;
+    IO_STATS stats;		/* reads made by the workers */
+    loff_t next;
+} PREFETCH_POOL;
+
+static __thread PREFETCH_POOL pool;
 
-unsigned device_no;
+static void prefetch_start(int threads);
+
+/**
+ * Account for a read or write request.
+ *
+ * @param[in,out] stats Counters to update
+ * @param[in,out] next  End of the previous request
+ * @param[in]   pos     Byte offset of the request
+ * @param[in]   size    Number of bytes transferred
+ * @param[in]   write   Non-zero for a write
+ */
+static void io_count(IO_STATS * stats, loff_t * next, loff_t pos, size_t size,
+		     int write)
+{
+    if (write) {
+	stats->writes++;
+	stats->write_bytes += size;
+    } else {
+	stats->reads++;
+	stats->read_bytes += size;
+    }
+    if (pos != *next)
+	stats->seeks++;
+    *next = pos + size;
+}
+
+__thread unsigned device_no;
 
 #ifdef __DJGPP__
 #include "volume.h"		/* DOS lowlevel disk access functions */
@@ -77,16 +261,60 @@ loff_t llseek(int fd, loff_t offset, int whence)
 }
 #endif
 
+/**
+ * Map the whole device, if possible. On failure the normal read path is
+ * used instead.
+ */
+static void map_open(void)
+{
+    void *p;
+
+    map_size = llseek(fd, 0, SEEK_END);
+    if (map_size <= 0 || map_size != (loff_t) (size_t) map_size)
+	return;
+    p = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) {
+	if (verbose)
+	    report("Cannot map filesystem (%s), using read().\n",
+		   strerror(errno));
+	return;
+    }
+    map = p;
+}
+
+/**
+ * Die if a range is not inside the mapping, as a short read would.
+ */
+static void map_check(loff_t pos, int size)
+{
+    if (pos < 0 || pos + size > map_size)
+	die("Got %lld bytes instead of %d at %lld",
+	    pos < map_size ? (long long)(map_size - pos) : 0LL, size, pos);
+}
+
 void fs_open(char *path, int rw)
 {
     struct stat stbuf;
 
-    if ((fd = open(path, rw ? O_RDWR : O_RDONLY)) < 0) {
-	perror("open");
-	exit(6);
-    }
-    changes = last = NULL;
+    if ((fd = open(path, rw ? O_RDWR : O_RDONLY)) < 0)
+	pdie("open %s", path);
+    dev_path = path;
+    changes = NULL;
+    n_changes = max_changes = 0;
+    n_queued = 0;
     did_change = 0;
+    memset(&io_stats, 0, sizeof(io_stats));
+    io_next = 0;
+    memset(cache, 0, sizeof(cache));
+    cache_clock = 0;
+    async_io = ioq_init(fd);
+    journal_head = 0;
+    map = NULL;
+    if (mmap_io)
+	map_open();
+    if (!map && !async_io)
+	prefetch_start(scan_threads);
+    n_mirrors = 0;
 
 #ifndef _DJGPP_
     if (fstat(fd, &stbuf) < 0)
@@ -108,6 +336,480 @@ void fs_open(char *path, int rw)
 #endif
 }
 
+void fs_mirror(loff_t pos, loff_t size, loff_t copy)
+{
+    int i;
+
+    for (i = 0; i < n_mirrors; i++)
+	if (mirrors[i].pos == pos && mirrors[i].copy == copy)
+	    return;
+    if (n_mirrors == MAX_MIRRORS)
+	die("Internal error: too many mirrored regions");
+    mirrors[n_mirrors].pos = pos;
+    mirrors[n_mirrors].size = size;
+    mirrors[n_mirrors].copy = copy;
+    n_mirrors++;
+}
+
+/**
+ * Check whether an offset is the start or end of a mirrored region. Changes
+ * are never merged across such an edge, so each change is either entirely
+ * inside or entirely outside every mirrored region.
+ */
+static int mirror_edge(loff_t pos)
+{
+    int i;
+
+    for (i = 0; i < n_mirrors; i++)
+	if (pos == mirrors[i].pos || pos == mirrors[i].pos + mirrors[i].size)
+	    return 1;
+    return 0;
+}
+
+/**
+ * Find the first pending change that ends after the specified offset.
+ *
+ * @param[in]   pos     Byte offset, relative to the beginning of the partition
+ *
+ * @return      Index into changes[], or n_changes if there is no such change
+ */
+static int change_first(loff_t pos)
+{
+    int lo = 0, hi = n_changes, mid;
+
+    while (lo < hi) {
+	mid = (lo + hi) / 2;
+	if (changes[mid].pos + changes[mid].size > pos)
+	    hi = mid;
+	else
+	    lo = mid + 1;
+    }
+    return lo;
+}
+
+/**
+ * Read exactly SIZE bytes at POS, dying on errors and short reads.
+ */
+static void read_at(loff_t pos, int size, void *data)
+{
+    ssize_t got;
+
+    got = pread64(fd, data, size, pos);
+    io_stats.syscalls++;
+    io_count(&io_stats, &io_next, pos, size, 0);
+    if (got < 0)
+	pdie("Read %d bytes at %lld", size, pos);
+    if (got != size)
+	die("Got %d bytes instead of %d at %lld", (int)got, size, pos);
+}
+
+/**
+ * Wait for a read ahead request on the slot to finish. A slot whose read
+ * failed is simply dropped; the data will be read again synchronously when
+ * it is actually needed, which then reports the error.
+ */
+static void cache_settle(CACHE_SLOT * slot)
+{
+    if (!slot->pending)
+	return;
+    ioq_wait(&slot->req);
+    slot->pending = 0;
+    if (slot->req.res != slot->size)
+	slot->size = 0;
+}
+
+/**
+ * Find the cache slot holding all of the specified range, and mark it as
+ * most recently used.
+ *
+ * @param[in]   pos     Byte offset, relative to the beginning of the partition
+ * @param[in]   size    Number of bytes
+ *
+ * @return      The slot, or NULL if the range is not cached in one piece
+ */
+static CACHE_SLOT *cache_lookup(loff_t pos, int size)
+{
+    int i;
+
+    for (i = 0; i < CACHE_SLOTS; i++)
+	if (cache[i].size && cache[i].pos <= pos &&
+	    pos + size <= cache[i].pos + cache[i].size) {
+	    cache_settle(&cache[i]);
+	    if (!cache[i].size)
+		return NULL;
+	    cache[i].lru = ++cache_clock;
+	    return &cache[i];
+	}
+    return NULL;
+}
+
+/**
+ * Pick the least recently used slot and make room for SIZE bytes in it.
+ */
+static CACHE_SLOT *cache_evict(int size)
+{
+    CACHE_SLOT *slot;
+    int i;
+
+    slot = &cache[0];
+    for (i = 1; i < CACHE_SLOTS; i++)
+	if (cache[i].lru < slot->lru)
+	    slot = &cache[i];
+    cache_settle(slot);
+    if (slot->alloc < size) {
+	free(slot->data);
+	slot->data = alloc(slot->alloc = size);
+    }
+    slot->size = 0;
+    return slot;
+}
+
+/**
+ * Copy data that was just written to disk into any cache slot it overlaps.
+ */
+static void cache_update(loff_t pos, int size, const void *data)
+{
+    loff_t start, end;
+    int i;
+
+    for (i = 0; i < CACHE_SLOTS; i++) {
+	cache_settle(&cache[i]);
+	if (!cache[i].size)
+	    continue;
+	start = pos > cache[i].pos ? pos : cache[i].pos;
+	end = pos + size < cache[i].pos + cache[i].size ?
+	    pos + size : cache[i].pos + cache[i].size;
+	if (start < end)
+	    memcpy(cache[i].data + (start - cache[i].pos),
+		   (const char *)data + (start - pos), end - start);
+    }
+}
+
+static void cache_drop(void)
+{
+    int i;
+
+    for (i = 0; i < CACHE_SLOTS; i++) {
+	cache_settle(&cache[i]);
+	free(cache[i].data);
+    }
+    memset(cache, 0, sizeof(cache));
+}
+
+/**
+ * Return the queued prefetch slot that was queued first, or NULL. Called
+ * with the pool lock held.
+ */
+static PREFETCH *prefetch_next(PREFETCH_POOL * p)
+{
+    PREFETCH *next = NULL;
+    int i;
+
+    for (i = 0; i < PREFETCH_SLOTS; i++)
+	if (p->slot[i].state == PF_QUEUED &&
+	    (!next || (int)(p->slot[i].seq - next->seq) < 0))
+	    next = &p->slot[i];
+    return next;
+}
+
+static void *prefetch_worker(void *arg)
+{
+    PREFETCH_POOL *p = arg;
+    PREFETCH *slot;
+    ssize_t got;
+
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+	while (!p->stop && !(slot = prefetch_next(p)))
+	    pthread_cond_wait(&p->work, &p->lock);
+	if (p->stop)
+	    break;
+	slot->state = PF_BUSY;
+	pthread_mutex_unlock(&p->lock);
+	got = pread64(p->fd, slot->data, slot->size, slot->pos);
+	pthread_mutex_lock(&p->lock);
+	slot->res = got < 0 ? -errno : got;
+	slot->state = PF_DONE;
+	p->stats.syscalls++;
+	io_count(&p->stats, &p->next, slot->pos, slot->size, 0);
+	pthread_cond_broadcast(&p->done);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+static void prefetch_start(int threads)
+{
+    memset(&pool, 0, sizeof(pool));
+    pool.fd = fd;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.work, NULL);
+    pthread_cond_init(&pool.done, NULL);
+    pool.active = 1;
+    if (threads > MAX_SCAN_THREADS)
+	threads = MAX_SCAN_THREADS;
+    for (pool.n_workers = 0; pool.n_workers < threads; pool.n_workers++)
+	if (pthread_create(&pool.workers[pool.n_workers], NULL,
+			   prefetch_worker, &pool))
+	    break;
+}
+
+static void prefetch_stop(void)
+{
+    int i;
+
+    if (!pool.active)
+	return;
+    pthread_mutex_lock(&pool.lock);
+    pool.stop = 1;
+    pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.lock);
+    for (i = 0; i < pool.n_workers; i++)
+	pthread_join(pool.workers[i], NULL);
+    io_stats.reads += pool.stats.reads;
+    io_stats.read_bytes += pool.stats.read_bytes;
+    io_stats.syscalls += pool.stats.syscalls;
+    io_stats.seeks += pool.stats.seeks;
+    for (i = 0; i < PREFETCH_SLOTS; i++)
+	free(pool.slot[i].data);
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.work);
+    pthread_cond_destroy(&pool.done);
+    memset(&pool, 0, sizeof(pool));
+}
+
+/**
+ * Release a prefetch slot, waiting for its worker if it is being read.
+ * Called with the pool lock held.
+ */
+static void prefetch_release(PREFETCH * slot)
+{
+    while (slot->state == PF_BUSY)
+	pthread_cond_wait(&pool.done, &pool.lock);
+    free(slot->data);
+    slot->data = NULL;
+    slot->state = PF_FREE;
+}
+
+/**
+ * Queue a range for the workers, unless it is already queued. Without a free
+ * slot, the one read longest ago is reused: data nobody took by then is for
+ * a directory the walk skipped or dropped.
+ *
+ * @return      Zero if every slot is still queued or being read, or there
+ *              is no memory for the range
+ */
+static int prefetch_queue(loff_t pos, int size)
+{
+    PREFETCH *slot = NULL, *done = NULL;
+    int i, queued = 1;
+
+    pthread_mutex_lock(&pool.lock);
+    for (i = 0; i < PREFETCH_SLOTS; i++) {
+	if (pool.slot[i].state != PF_FREE && pool.slot[i].pos <= pos &&
+	    pos + size <= pool.slot[i].pos + pool.slot[i].size) {
+	    goto out;
+	}
+	if (pool.slot[i].state == PF_FREE) {
+	    if (!slot)
+		slot = &pool.slot[i];
+	} else if (pool.slot[i].state == PF_DONE &&
+		   (!done || (int)(pool.slot[i].seq - done->seq) < 0))
+	    done = &pool.slot[i];
+    }
+    if (!slot && done) {
+	prefetch_release(done);
+	slot = done;
+    }
+    /* Only a hint, so it is dropped rather than dying with the lock held
+     * if there is no memory for it */
+    if (slot && (slot->data = malloc(size))) {
+	slot->pos = pos;
+	slot->size = size;
+	slot->seq = pool.seq++;
+	slot->state = PF_QUEUED;
+	pthread_cond_signal(&pool.work);
+    } else
+	queued = 0;
+  out:
+    pthread_mutex_unlock(&pool.lock);
+    return queued;
+}
+
+/**
+ * Move a prefetched range that covers the specified one into the cache
+ * slot SLOT, waiting for the worker if it is still being read.
+ *
+ * @return      Non-zero if SLOT now holds the range. Zero if it was not
+ *              prefetched, not started yet or could not be read; the
+ *              caller then reads it itself.
+ */
+static int prefetch_take(CACHE_SLOT * slot, loff_t pos, int size)
+{
+    PREFETCH *walk = NULL;
+    char *data;
+    int i, okay = 0;
+
+    if (!pool.n_workers)
+	return 0;
+    pthread_mutex_lock(&pool.lock);
+    for (i = 0; i < PREFETCH_SLOTS; i++)
+	if (pool.slot[i].state != PF_FREE && pool.slot[i].pos <= pos &&
+	    pos + size <= pool.slot[i].pos + pool.slot[i].size) {
+	    walk = &pool.slot[i];
+	    break;
+	}
+    if (walk) {
+	while (walk->state == PF_BUSY)
+	    pthread_cond_wait(&pool.done, &pool.lock);
+	if (walk->state == PF_DONE && walk->res == walk->size) {
+	    data = slot->data;
+	    slot->data = walk->data;
+	    slot->alloc = walk->size;
+	    slot->pos = walk->pos;
+	    slot->size = walk->size;
+	    walk->data = data;
+	    okay = 1;
+	}
+	prefetch_release(walk);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return okay;
+}
+
+/**
+ * Forget prefetched data that a write to the disk made stale.
+ */
+static void prefetch_drop(loff_t pos, int size)
+{
+    int i;
+
+    if (!pool.n_workers)
+	return;
+    pthread_mutex_lock(&pool.lock);
+    for (i = 0; i < PREFETCH_SLOTS; i++)
+	if (pool.slot[i].state != PF_FREE && pool.slot[i].pos < pos + size &&
+	    pos < pool.slot[i].pos + pool.slot[i].size)
+	    prefetch_release(&pool.slot[i]);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+void fs_cache(loff_t pos, int size)
+{
+    CACHE_SLOT *slot;
+
+    if (map)
+	return;
+    if (cache_lookup(pos, size))
+	return;
+    slot = cache_evict(size);
+    if (prefetch_take(slot, pos, size)) {
+	slot->lru = ++cache_clock;
+	return;
+    }
+    read_at(pos, size, slot->data);
+    slot->pos = pos;
+    slot->size = size;
+    slot->lru = ++cache_clock;
+}
+
+void fs_will_need(loff_t pos, int size)
+{
+    loff_t start;
+
+    if (map) {
+	start = pos & ~(loff_t) (getpagesize() - 1);
+	if (pos >= 0 && pos + size <= map_size)
+	    madvise(map + start, pos + size - start, MADV_WILLNEED);
+	io_stats.syscalls++;
+    } else if (!pool.n_workers || !prefetch_queue(pos, size)) {
+	/* What the pool has no room for is still worth a hint to the kernel */
+	posix_fadvise(fd, pos, size, POSIX_FADV_WILLNEED);
+	io_stats.syscalls++;
+    }
+}
+
+void fs_read_ahead(loff_t pos, int size)
+{
+    CACHE_SLOT *slot;
+    int i;
+
+    if (map) {
+	fs_will_need(pos, size);
+	return;
+    }
+    for (i = 0; i < CACHE_SLOTS; i++)
+	if (cache[i].size && cache[i].pos <= pos &&
+	    pos + size <= cache[i].pos + cache[i].size)
+	    return;
+    if (!async_io) {
+	fs_will_need(pos, size);
+	return;
+    }
+    slot = cache_evict(size);
+    slot->pos = pos;
+    slot->size = size;
+    slot->lru = ++cache_clock;
+    slot->iov.iov_base = slot->data;
+    slot->iov.iov_len = size;
+    slot->req.pos = pos;
+    slot->req.iov = &slot->iov;
+    slot->req.iovcnt = 1;
+    slot->req.write = 0;
+    slot->pending = 1;
+    io_count(&io_stats, &io_next, pos, size, 0);
+    ioq_submit(&slot->req);
+}
+
+/**
+ * Apply the pending changes that overlap a range that was just read.
+ *
+ * @param[in]   pos     Byte offset, relative to the beginning of the partition
+ * @param[in]   size    Number of bytes
+ * @param[out]  data    Data read from pos, as it is on disk
+ */
+static void change_apply(loff_t pos, int size, void *data)
+{
+    CHANGE *walk;
+    int i;
+
+    for (i = change_first(pos); i < n_changes; i++) {
+	walk = &changes[i];
+	if (walk->pos >= pos + size)
+	    break;
+	if (walk->pos < pos)
+	    memcpy(data, (char *)walk->data + pos - walk->pos,
+		   min(size, walk->size - pos + walk->pos));
+	else
+	    memcpy((char *)data + walk->pos - pos, walk->data,
+		   min(walk->size, size + pos - walk->pos));
+    }
+}
+
+/**
+ * Apply all pending changes, including those mirrored into copies, to a
+ * range that was just read.
+ *
+ * @param[in]   pos     Byte offset, relative to the beginning of the partition
+ * @param[in]   size    Number of bytes
+ * @param[out]  data    Data read from pos, as it is on disk
+ */
+static void overlay_apply(loff_t pos, int size, void *data)
+{
+    loff_t start, end;
+    int i;
+
+    change_apply(pos, size, data);
+    for (i = 0; i < n_mirrors; i++) {
+	start = pos > mirrors[i].copy ? pos : mirrors[i].copy;
+	end = pos + size < mirrors[i].copy + mirrors[i].size ?
+	    pos + size : mirrors[i].copy + mirrors[i].size;
+	if (start < end)
+	    change_apply(start - mirrors[i].copy + mirrors[i].pos,
+			 end - start, (char *)data + (start - pos));
+    }
+}
+
 /**
  * Read data from the partition, accounting for any pending updates that are
  * queued for writing.
@@ -119,29 +821,72 @@ void fs_open(char *path, int rw)
  */
 void fs_read(loff_t pos, int size, void *data)
 {
-    CHANGE *walk;
-    int got;
+    CACHE_SLOT *slot;
 
-    if (llseek(fd, pos, 0) != pos)
-	pdie("Seek to %lld", pos);
-    if ((got = read(fd, data, size)) < 0)
-	pdie("Read %d bytes at %lld", size, pos);
-    if (got != size)
-	die("Got %d bytes instead of %d at %lld", got, size, pos);
-    for (walk = changes; walk; walk = walk->next) {
-	if (walk->pos < pos + size && walk->pos + walk->size > pos) {
-	    if (walk->pos < pos)
-		memcpy(data, (char *)walk->data + pos - walk->pos, min(size,
-								       walk->
-								       size -
-								       pos +
-								       walk->
-								       pos));
-	    else
-		memcpy((char *)data + walk->pos - pos, walk->data,
-		       min(walk->size, size + pos - walk->pos));
+    if (map) {
+	map_check(pos, size);
+	memcpy(data, map + pos, size);
+	return;
+    }
+    if ((slot = cache_lookup(pos, size)))
+	memcpy(data, slot->data + (pos - slot->pos), size);
+    else
+	read_at(pos, size, data);
+    overlay_apply(pos, size, data);
+}
+
+void *fs_map(loff_t pos, int size)
+{
+    if (!map)
+	return NULL;
+    map_check(pos, size);
+    return map + pos;
+}
+
+void fs_read_batch(FS_IO * io, int n)
+{
+    CACHE_SLOT *slot;
+    IOQ_REQ *reqs;
+    struct iovec *iov;
+    int i;
+
+    if (map) {
+	for (i = 0; i < n; i++)
+	    fs_read(io[i].pos, io[i].size, io[i].data);
+	return;
+    }
+    reqs = talloc(n * sizeof(IOQ_REQ));
+    iov = talloc(n * sizeof(struct iovec));
+    for (i = 0; i < n; i++) {
+	reqs[i].done = 1;
+	reqs[i].res = io[i].size;
+	if ((slot = cache_lookup(io[i].pos, io[i].size))) {
+	    memcpy(io[i].data, slot->data + (io[i].pos - slot->pos),
+		   io[i].size);
+	    continue;
+	}
+	iov[i].iov_base = io[i].data;
+	iov[i].iov_len = io[i].size;
+	reqs[i].pos = io[i].pos;
+	reqs[i].iov = &iov[i];
+	reqs[i].iovcnt = 1;
+	reqs[i].write = 0;
+	io_count(&io_stats, &io_next, io[i].pos, io[i].size, 0);
+	ioq_submit(&reqs[i]);
+    }
+    for (i = 0; i < n; i++) {
+	ioq_wait(&reqs[i]);
+	if (reqs[i].res < 0) {
+	    errno = -reqs[i].res;
+	    pdie("Read %d bytes at %lld", io[i].size, io[i].pos);
 	}
+	if (reqs[i].res != io[i].size)
+	    die("Got %d bytes instead of %d at %lld", (int)reqs[i].res,
+		io[i].size, io[i].pos);
+	overlay_apply(io[i].pos, io[i].size, io[i].data);
     }
+    tfree(iov);
+    tfree(reqs);
 }
 
 int fs_test(loff_t pos, int size)
@@ -149,84 +894,900 @@ int fs_test(loff_t pos, int size)
     void *scratch;
     int okay;
 
-    if (llseek(fd, pos, 0) != pos)
-	pdie("Seek to %lld", pos);
     scratch = alloc(size);
-    okay = read(fd, scratch, size) == size;
+    okay = pread64(fd, scratch, size, pos) == size;
+    io_stats.syscalls++;
+    io_count(&io_stats, &io_next, pos, size, 0);
     free(scratch);
     return okay;
 }
 
-void fs_write(loff_t pos, int size, void *data)
+/**
+ * Open the descriptor fs_scan() reads through, once per fs_open(). The data
+ * is thrown away, so it bypasses the page cache where the device allows it,
+ * not to push everything else out of it.
+ */
+static void scan_open(void)
+{
+    if (scan_fd < 0 && (scan_fd = open(dev_path, O_RDONLY | O_DIRECT)) < 0)
+	scan_fd = fd;
+}
+
+static void scan_close(void)
+{
+    if (scan_fd >= 0 && scan_fd != fd)
+	close(scan_fd);
+    scan_fd = -1;
+}
+
+/**
+ * Read SIZE bytes at POS for fs_scan(), falling back to the buffered
+ * descriptor for good if the device refuses direct I/O there.
+ *
+ * @return      Non-zero if all of it could be read
+ */
+static int scan_read(SCAN * scan, char *buf, loff_t pos, loff_t size)
+{
+    ssize_t got;
+
+    got = pread64(scan_fd, buf, size, pos);
+    io_stats.syscalls++;
+    io_count(&io_stats, &io_next, pos, size, 0);
+    if (got < 0 && errno == EINVAL && scan_fd != fd) {
+	scan_close();
+	scan_fd = fd;
+	return scan_read(scan, buf, pos, size);
+    }
+    return got == size;
+}
+
+/**
+ * Bisect a range that could not be read down to the units that cannot be.
+ *
+ * @param[in]   pos     Byte offset of the range
+ * @param[in]   size    Multiple of scan->unit
+ */
+static void scan_narrow(SCAN * scan, char *buf, loff_t pos, loff_t size)
+{
+    loff_t half;
+
+    if (size <= scan->unit) {
+	scan->bad(pos, scan->arg);
+	return;
+    }
+    half = size / scan->unit / 2 * scan->unit;
+    if (!scan_read(scan, buf, pos, half))
+	scan_narrow(scan, buf, pos, half);
+    if (!scan_read(scan, buf, pos + half, size - half))
+	scan_narrow(scan, buf, pos + half, size - half);
+}
+
+void fs_scan(const FS_EXTENT * ext, int n, int unit,
+	     void (*bad) (loff_t pos, void *arg), void *arg)
+{
+    SCAN *scan;
+    IOQ_REQ *req;
+    loff_t at, chunk, total, stride;
+    int e, i, j, head, busy;
+
+    if (!n)
+	return;
+    scan_open();
+    chunk = SCAN_CHUNK / unit * unit;
+
+    /* Most calls are for the few clusters of a small file, so buffers are
+     * only as large, and only as many, as the extents need */
+    for (total = e = 0; e < n; e++)
+	total += ext[e].size;
+    if (total < chunk)
+	chunk = total;
+    for (i = e = 0; e < n && i < SCAN_DEPTH; e++)
+	i += (ext[e].size + chunk - 1) / chunk;
+
+    /* The kernel writes to the requests and their buffers until they are
+     * done, so they are all allocated before the first one is started, and
+     * tracked: if BAD dies, fs_abort() finishes what is in flight before
+     * tfree_all() releases them */
+    scan = talloc(sizeof(SCAN));
+    scan->unit = unit;
+    scan->bad = bad;
+    scan->arg = arg;
+    scan->depth = i < SCAN_DEPTH ? i : SCAN_DEPTH;
+    stride = (chunk + SCAN_ALIGN - 1) & ~(loff_t) (SCAN_ALIGN - 1);
+    scan->mem = talloc(scan->depth * stride + SCAN_ALIGN - 1);
+    for (i = 0; i < scan->depth; i++)
+	scan->buf[i] = (char *)(((uintptr_t) scan->mem + SCAN_ALIGN - 1) &
+				~(uintptr_t) (SCAN_ALIGN - 1)) + i * stride;
+
+    /* Requests are started in order and finished in order, so that BAD is
+     * called in order too; slot i % depth holds the i-th request */
+    e = head = busy = 0;
+    at = ext[0].pos;
+    while (busy || e < n) {
+	while (busy < scan->depth && e < n) {
+	    i = (head + busy) % scan->depth;
+	    req = &scan->req[i];
+	    scan->iov[i].iov_base = scan->buf[i];
+	    scan->iov[i].iov_len = ext[e].pos + ext[e].size - at < chunk ?
+		ext[e].pos + ext[e].size - at : chunk;
+	    req->pos = at;
+	    req->iov = &scan->iov[i];
+	    req->iovcnt = 1;
+	    req->write = 0;
+	    io_count(&io_stats, &io_next, at, scan->iov[i].iov_len, 0);
+	    ioq_submit_fd(req, scan_fd);
+	    busy++;
+	    if ((at += scan->iov[i].iov_len) == ext[e].pos + ext[e].size &&
+		++e < n)
+		at = ext[e].pos;
+	}
+	i = head;
+	req = &scan->req[i];
+	ioq_wait(req);
+	if (req->res != scan->iov[i].iov_len) {
+	    /* BAD may die, which it must not do with requests in flight */
+	    for (j = 1; j < busy; j++)
+		ioq_wait(&scan->req[(head + j) % scan->depth]);
+	    if (req->res != -EINVAL || scan_fd == fd ||
+		!scan_read(scan, scan->buf[i], req->pos, scan->iov[i].iov_len))
+		scan_narrow(scan, scan->buf[i], req->pos,
+			    scan->iov[i].iov_len);
+	}
+	head = (head + 1) % scan->depth;
+	busy--;
+    }
+
+    tfree(scan->mem);
+    tfree(scan);
+}
+
+/**
+ * Queue a change, merging it with every queued change that it overlaps or
+ * touches.
+ *
+ * @param[in]   pos     Byte offset, relative to the beginning of the partition
+ * @param[in]   size    Number of bytes to write
+ * @param[in]   data    Data to write
+ */
+static void change_add(loff_t pos, int size, void *data)
+{
+    CHANGE *this;
+    loff_t start, end;
+    int first, last, i;
+    char *buf;
+
+    /* Entries first..last-1 overlap or are adjacent to the new data */
+    first = change_first(mirror_edge(pos) ? pos : pos - 1);
+    for (last = first; last < n_changes; last++)
+	if (changes[last].pos > pos + size ||
+	    (changes[last].pos == pos + size && mirror_edge(pos + size)))
+	    break;
+
+    if (first == last) {
+	if (n_changes == max_changes) {
+	    max_changes = max_changes ? max_changes * 2 : 64;
+	    changes = realloc(changes, max_changes * sizeof(CHANGE));
+	    if (!changes)
+		pdie("realloc");
+	}
+	memmove(changes + first + 1, changes + first,
+		(n_changes - first) * sizeof(CHANGE));
+	if (++n_changes > io_stats.peak_changes)
+	    io_stats.peak_changes = n_changes;
+	this = &changes[first];
+	this->pos = pos;
+	this->size = this->alloc = size;
+	if (map)
+	    this->data = NULL;
+	else
+	    memcpy(this->data = alloc(size), data, size);
+	return;
+    }
+
+    this = &changes[first];
+    start = this->pos < pos ? this->pos : pos;
+    end = changes[last - 1].pos + changes[last - 1].size;
+    if (end < pos + size)
+	end = pos + size;
+
+    if (map) {
+	memmove(changes + first + 1, changes + last,
+		(n_changes - last) * sizeof(CHANGE));
+	n_changes -= last - first - 1;
+	this->pos = start;
+	this->size = this->alloc = end - start;
+	return;
+    }
+
+    if (last == first + 1 && this->pos == start) {
+	/* Overwrite or extend a single change in place. Grow the buffer
+	 * geometrically so that long runs of appends stay linear. */
+	if (end - start > this->alloc) {
+	    this->alloc = this->alloc * 2 > end - start ?
+		this->alloc * 2 : end - start;
+	    if (!(this->data = realloc(this->data, this->alloc)))
+		pdie("realloc");
+	}
+    } else {
+	buf = alloc(end - start);
+	for (i = first; i < last; i++) {
+	    memcpy(buf + (changes[i].pos - start), changes[i].data,
+		   changes[i].size);
+	    free(changes[i].data);
+	}
+	memmove(changes + first + 1, changes + last,
+		(n_changes - last) * sizeof(CHANGE));
+	n_changes -= last - first - 1;
+	this->data = buf;
+	this->pos = start;
+	this->alloc = end - start;
+    }
+    this->size = end - start;
+    memcpy((char *)this->data + (pos - start), data, size);
+}
+
+/**
+ * Write data to the disk right away, updating the cache.
+ */
+static void write_at(loff_t pos, int size, void *data)
 {
-    CHANGE *new;
     int did;
 
+    did = pwrite64(fd, data, size, pos);
+    io_stats.syscalls++;
+    io_count(&io_stats, &io_next, pos, size, 1);
+    if (did == size) {
+	cache_update(pos, size, data);
+	prefetch_drop(pos, size);
+	return;
+    }
+    if (did < 0)
+	pdie("Write %d bytes at %lld", size, pos);
+    die("Wrote %d bytes instead of %d at %lld", did, size, pos);
+}
+
+void fs_write(loff_t pos, int size, void *data)
+{
+    MIRROR *m;
+    loff_t edge;
+    int i;
+
+    /* Split writes that cross the edge of a mirrored region */
+    for (i = 0; i < n_mirrors; i++) {
+	m = &mirrors[i];
+	edge = pos < m->pos ? m->pos : m->pos + m->size;
+	if (pos < edge && edge < pos + size) {
+	    fs_write(pos, edge - pos, data);
+	    fs_write(edge, size - (edge - pos), (char *)data + (edge - pos));
+	    return;
+	}
+    }
+
+    if (map) {
+	map_check(pos, size);
+	memmove(map + pos, data, size);
+    }
     if (write_immed) {
 	did_change = 1;
-	if (llseek(fd, pos, 0) != pos)
-	    pdie("Seek to %lld", pos);
-	if ((did = write(fd, data, size)) == size)
-	    return;
-	if (did < 0)
-	    pdie("Write %d bytes at %lld", size, pos);
-	die("Wrote %d bytes instead of %d at %lld", did, size, pos);
-    }
-    new = alloc(sizeof(CHANGE));
-    new->pos = pos;
-    memcpy(new->data = alloc(new->size = size), data, size);
-    new->next = NULL;
-    if (last)
-	last->next = new;
-    else
-	changes = new;
-    last = new;
+	write_at(pos, size, data);
+    }
+    for (i = 0; i < n_mirrors; i++) {
+	m = &mirrors[i];
+	if (pos < m->pos || pos + size > m->pos + m->size)
+	    continue;
+	if (map) {
+	    map_check(pos - m->pos + m->copy, size);
+	    memmove(map + (pos - m->pos + m->copy), map + pos, size);
+	}
+	if (write_immed)
+	    write_at(pos - m->pos + m->copy, size, data);
+    }
+    if (write_immed)
+	return;
+    n_queued++;
+    change_add(pos, size, data);
 }
 
+/* One block-aligned run of pending changes being flushed */
+typedef struct {
+    int first, last;		/* changes[first..last-1] */
+    loff_t delta;		/* written this far from where they belong */
+    loff_t start, end;
+    char *buf;			/* on-disk data for the whole run */
+    struct iovec *iov;
+    IOQ_REQ req;
+} FLUSH_RUN;
+
+/**
+ * Write the changes of a run on their own, without filling the gaps. Used
+ * when the device ends before the aligned end of the run.
+ *
+ * @return      Number of requests issued
+ */
+static int flush_unaligned(FLUSH_RUN * run)
+{
+    int i;
+
+    for (i = run->first; i < run->last; i++) {
+	io_stats.syscalls++;
+	io_count(&io_stats, &io_next, changes[i].pos + run->delta,
+		 changes[i].size, 1);
+	if (pwrite64(fd, changes[i].data, changes[i].size,
+		     changes[i].pos + run->delta) != changes[i].size)
+	    fprintf(stderr, "Writing %d bytes at %lld failed: %s\n",
+		    changes[i].size, (long long)(changes[i].pos + run->delta),
+		    strerror(errno));
+    }
+    return run->last - run->first;
+}
+
+/**
+ * Write out a batch of runs from the mapping, which already holds both the
+ * changes and the on-disk data around them.
+ *
+ * @return      Number of requests issued
+ */
+static int flush_mapped(FLUSH_RUN * runs, int n)
+{
+    FLUSH_RUN *run;
+    int i;
+
+    for (i = 0; i < n; i++) {
+	run = &runs[i];
+	if (run->end > map_size)
+	    run->end = map_size;
+	run->iov = talloc(sizeof(struct iovec));
+	run->iov->iov_base = map + run->start;
+	run->iov->iov_len = run->end - run->start;
+	run->req.pos = run->start;
+	run->req.iov = run->iov;
+	run->req.iovcnt = 1;
+	run->req.write = 1;
+	io_count(&io_stats, &io_next, run->start, run->end - run->start, 1);
+	ioq_submit(&run->req);
+    }
+    for (i = 0; i < n; i++) {
+	run = &runs[i];
+	ioq_wait(&run->req);
+	if (run->req.res < 0)
+	    fprintf(stderr, "Writing %lld bytes at %lld failed: %s\n",
+		    (long long)(run->end - run->start),
+		    (long long)run->start, strerror(-run->req.res));
+	else if (run->req.res != run->end - run->start)
+	    fprintf(stderr, "Wrote %lld bytes instead of %lld bytes at %lld.\n",
+		    (long long)run->req.res,
+		    (long long)(run->end - run->start), (long long)run->start);
+	tfree(run->iov);
+    }
+    return n;
+}
+
+/**
+ * Write out a batch of runs. The on-disk data for the gaps of all runs is
+ * read first, with all reads in flight at once; then every run is written
+ * with one vectored request, again all in flight at once.
+ *
+ * @param[in]   runs    Runs to write; they must not share any FLUSH_BLOCK
+ * @param[in]   n       Number of runs
+ *
+ * @return      Number of requests issued
+ */
+static int flush_batch(FLUSH_RUN * runs, int n)
+{
+    FLUSH_RUN *run;
+    struct iovec rd;
+    loff_t at;
+    int i, j, k, reqs;
+    ssize_t got;
+
+    if (map)
+	return flush_mapped(runs, n);
+    for (i = 0; i < n; i++) {
+	run = &runs[i];
+	run->buf = talloc(run->end - run->start);
+	run->iov = talloc((2 * (run->last - run->first) + 1) *
+			  sizeof(struct iovec));
+	/* The read needs its own iovec until it is done; borrow the last
+	 * slot of the write vector, which is only filled in afterwards. */
+	rd.iov_base = run->buf;
+	rd.iov_len = run->end - run->start;
+	run->iov[2 * (run->last - run->first)] = rd;
+	run->req.pos = run->start;
+	run->req.iov = &run->iov[2 * (run->last - run->first)];
+	run->req.iovcnt = 1;
+	run->req.write = 0;
+	io_count(&io_stats, &io_next, run->start, run->end - run->start, 0);
+	ioq_submit(&run->req);
+    }
+    reqs = n;
+
+    for (i = 0; i < n; i++) {
+	run = &runs[i];
+	ioq_wait(&run->req);
+	got = run->req.res < 0 ? 0 : run->req.res;
+	if (got < changes[run->last - 1].pos + changes[run->last - 1].size +
+	    run->delta - run->start) {
+	    /* Short device; fall back to writing the changes alone */
+	    reqs += flush_unaligned(run);
+	    run->req.iovcnt = 0;
+	    continue;
+	}
+	if (got < run->end - run->start)
+	    run->end = run->start + got;
+
+	k = 0;
+	at = run->start;
+	for (j = run->first; j < run->last; j++) {
+	    if (changes[j].pos + run->delta > at) {
+		run->iov[k].iov_base = run->buf + (at - run->start);
+		run->iov[k++].iov_len = changes[j].pos + run->delta - at;
+	    }
+	    run->iov[k].iov_base = changes[j].data;
+	    run->iov[k++].iov_len = changes[j].size;
+	    at = changes[j].pos + run->delta + changes[j].size;
+	}
+	if (at < run->end) {
+	    run->iov[k].iov_base = run->buf + (at - run->start);
+	    run->iov[k++].iov_len = run->end - at;
+	}
+	run->req.iov = run->iov;
+	run->req.iovcnt = k;
+	run->req.write = 1;
+	io_count(&io_stats, &io_next, run->start, run->end - run->start, 1);
+	ioq_submit(&run->req);
+	reqs++;
+    }
+
+    for (i = 0; i < n; i++) {
+	run = &runs[i];
+	if (run->req.iovcnt) {
+	    ioq_wait(&run->req);
+	    if (run->req.res < 0)
+		fprintf(stderr, "Writing %lld bytes at %lld failed: %s\n",
+			(long long)(run->end - run->start),
+			(long long)run->start, strerror(-run->req.res));
+	    else if (run->req.res != run->end - run->start)
+		fprintf(stderr,
+			"Wrote %lld bytes instead of %lld bytes at %lld.\n",
+			(long long)run->req.res,
+			(long long)(run->end - run->start),
+			(long long)run->start);
+	}
+	tfree(run->iov);
+	tfree(run->buf);
+    }
+    return reqs;
+}
+
+/**
+ * Write out the pending changes from..to-1, grouped into block-aligned runs
+ * that are written with one vectored request each, a batch of runs at a
+ * time.
+ *
+ * @param[in]   runs    Scratch space for at least to - from runs
+ * @param[in]   from    Index of the first change
+ * @param[in]   to      Index of the first change not to write
+ * @param[in]   delta   Offset added to the position of every change
+ * @param[out]  n_runs  Incremented by the number of runs
+ *
+ * @return      Number of requests issued
+ */
+static int flush_changes(FLUSH_RUN * runs, int from, int to, loff_t delta,
+			 int *n_runs)
+{
+    loff_t run_end, erase, batch_bytes;
+    int first, last, reqs, n, batch, iovs;
+
+    reqs = n = batch = 0;
+    batch_bytes = 0;
+    for (first = from; first < to; first = last) {
+	erase = (changes[first].pos + delta) & ~(loff_t) (FLUSH_ERASE - 1);
+	run_end = (changes[first].pos + delta + changes[first].size +
+		   FLUSH_BLOCK - 1) & ~(loff_t) (FLUSH_BLOCK - 1);
+	iovs = 3;
+	for (last = first + 1; last < to; last++) {
+	    if (((changes[last].pos + delta) & ~(loff_t) (FLUSH_BLOCK - 1)) >
+		run_end)
+		break;
+	    if (changes[last].pos + delta + changes[last].size >
+		erase + FLUSH_ERASE)
+		break;
+	    if ((iovs += 2) > IOV_MAX)
+		break;
+	    run_end = (changes[last].pos + delta + changes[last].size +
+		       FLUSH_BLOCK - 1) & ~(loff_t) (FLUSH_BLOCK - 1);
+	}
+	runs[n].first = first;
+	runs[n].last = last;
+	runs[n].delta = delta;
+	runs[n].start = (changes[first].pos + delta) &
+	    ~(loff_t) (FLUSH_BLOCK - 1);
+	runs[n].end = run_end;
+
+	/* Runs in one batch are written concurrently, so a run that shares
+	 * a block with the previous one (split by the erase or iovec limit)
+	 * has to wait until that one is on disk. */
+	if (n > batch &&
+	    (batch_bytes + run_end - runs[n].start > FLUSH_BATCH ||
+	     runs[n].start < runs[n - 1].end)) {
+	    reqs += flush_batch(runs + batch, n - batch);
+	    batch = n;
+	    batch_bytes = 0;
+	}
+	batch_bytes += run_end - runs[n].start;
+	n++;
+    }
+    if (n > batch)
+	reqs += flush_batch(runs + batch, n - batch);
+    *n_runs += n;
+    return reqs;
+}
+
+/**
+ * Collect the ranges fs_flush() writes to: every change, and its copy in a
+ * mirrored region, widened to whole FLUSH_BLOCK units and merged where they
+ * touch.
+ *
+ * @param[out]  ext     Room for n_changes * (n_mirrors + 1) extents
+ *
+ * @return      Number of extents
+ */
+static int flush_extents(FS_EXTENT * ext)
+{
+    loff_t delta, start, end;
+    int n, i, j, from, to;
+
+    n = 0;
+    for (i = -1; i < n_mirrors; i++) {
+	if (i < 0) {
+	    from = 0;
+	    to = n_changes;
+	    delta = 0;
+	} else {
+	    from = change_first(mirrors[i].pos);
+	    to = change_first(mirrors[i].pos + mirrors[i].size);
+	    delta = mirrors[i].copy - mirrors[i].pos;
+	}
+	for (j = from; j < to; j++) {
+	    start = (changes[j].pos + delta) & ~(loff_t) (FLUSH_BLOCK - 1);
+	    end = (changes[j].pos + delta + changes[j].size + FLUSH_BLOCK - 1) &
+		~(loff_t) (FLUSH_BLOCK - 1);
+	    if (j > from && start <= ext[n - 1].pos + ext[n - 1].size)
+		ext[n - 1].size = end - ext[n - 1].pos;
+	    else {
+		ext[n].pos = start;
+		ext[n++].size = end - start;
+	    }
+	}
+    }
+    return n;
+}
+
+static uint32_t journal_sum(const void *data, size_t size)
+{
+    const unsigned char *p = data;
+    uint32_t hash = 2166136261U;
+
+    while (size--)
+	hash = (hash ^ *p++) * 16777619U;
+    return hash;
+}
+
+/**
+ * Write HEAD to the journal header and wait for it to be on disk.
+ *
+ * @return      Non-zero on success
+ */
+static int journal_mark(loff_t header, JOURNAL_HEAD * head)
+{
+    int ok;
+
+    ok = pwrite64(fd, head, sizeof(*head), header) == sizeof(*head);
+    io_count(&io_stats, &io_next, header, sizeof(*head), 1);
+    ok = ok && !fsync(fd);
+    io_stats.syscalls += 2;
+    return ok;
+}
+
+/**
+ * Save the original contents of everything fs_flush() is about to
+ * overwrite in the journal, then point the header to it.
+ *
+ * @return      Non-zero if the flush is covered by the journal
+ */
+static int journal_begin(void)
+{
+    FS_EXTENT *ext;
+    JOURNAL_HEAD head;
+    JOURNAL_REC *rec;
+    char *buf;
+    loff_t size;
+    ssize_t got;
+    int n, i;
+
+    if (!journal_head || !n_changes)
+	return 0;
+    /* A flush that rewrites the block of the header could tear it, and with
+     * it the only way to roll that flush back */
+    if (fs_pending(journal_head, sizeof(head))) {
+	report("The undo journal header would be overwritten, "
+	       "flushing without it.\n");
+	return 0;
+    }
+    ext = talloc(n_changes * (n_mirrors + 1) * sizeof(FS_EXTENT));
+    n = flush_extents(ext);
+    for (size = i = 0; i < n; i++)
+	size += sizeof(JOURNAL_REC) + ext[i].size;
+    if (size > journal_size) {
+	report("No room for an undo journal of %lld bytes.\n",
+	       (long long)size);
+	tfree(ext);
+	return 0;
+    }
+
+    buf = talloc(size);
+    for (size = i = 0; i < n; i++) {
+	rec = (JOURNAL_REC *) (buf + size);
+	size += sizeof(JOURNAL_REC);
+	/* The last block may extend past the end of the device */
+	got = pread64(fd, buf + size, ext[i].size, ext[i].pos);
+	io_stats.syscalls++;
+	io_count(&io_stats, &io_next, ext[i].pos, ext[i].size, 0);
+	if (got < 0)
+	    got = 0;
+	rec->pos = htole64(ext[i].pos);
+	rec->size = htole32(got);
+	rec->unused = 0;
+	size += got;
+    }
+    tfree(ext);
+
+    head.magic = htole32(JOURNAL_MAGIC);
+    head.size = htole32(size);
+    head.pos = htole64(journal_pos);
+    head.data_sum = htole32(journal_sum(buf, size));
+    head.sum = htole32(journal_sum(&head, offsetof(JOURNAL_HEAD, sum)));
+    got = pwrite64(fd, buf, size, journal_pos);
+    io_stats.syscalls++;
+    io_count(&io_stats, &io_next, journal_pos, size, 1);
+    tfree(buf);
+    if (got != size || fsync(fd) < 0 || !journal_mark(journal_head, &head)) {
+	fprintf(stderr, "Writing the undo journal failed: %s\n",
+		got < 0 ? strerror(errno) : "short write");
+	return 0;
+    }
+    io_stats.syscalls++;
+    if (verbose)
+	report("Saved %lld bytes of undo journal at %lld.\n", (long long)size,
+	       (long long)journal_pos);
+    return 1;
+}
+
+loff_t fs_undo_size(void)
+{
+    FS_EXTENT *ext;
+    loff_t size;
+    int n, i;
+
+    if (!n_changes)
+	return 0;
+    ext = talloc(n_changes * (n_mirrors + 1) * sizeof(FS_EXTENT));
+    n = flush_extents(ext);
+    for (size = i = 0; i < n; i++)
+	size += sizeof(JOURNAL_REC) + ext[i].size;
+    tfree(ext);
+    return size;
+}
+
+int fs_pending(loff_t pos, loff_t size)
+{
+    loff_t start, end, from, to;
+    int i, j;
+
+    start = pos & ~(loff_t) (FLUSH_BLOCK - 1);
+    end = (pos + size + FLUSH_BLOCK - 1) & ~(loff_t) (FLUSH_BLOCK - 1);
+    j = change_first(start);
+    if (j < n_changes && changes[j].pos < end)
+	return 1;
+    /* The same for the copies of the mirrored regions */
+    for (i = 0; i < n_mirrors; i++) {
+	from = start - mirrors[i].copy + mirrors[i].pos;
+	to = end - mirrors[i].copy + mirrors[i].pos;
+	if (from < mirrors[i].pos)
+	    from = mirrors[i].pos;
+	if (to > mirrors[i].pos + mirrors[i].size)
+	    to = mirrors[i].pos + mirrors[i].size;
+	if (from >= to)
+	    continue;
+	j = change_first(from);
+	if (j < n_changes && changes[j].pos < to)
+	    return 1;
+    }
+    return 0;
+}
+
+void fs_journal(loff_t header, loff_t pos, loff_t size)
+{
+    if (write_immed)
+	return;
+    journal_head = header;
+    journal_pos = pos;
+    journal_size = size < JOURNAL_MAX ? size : JOURNAL_MAX;
+}
+
+int fs_replay(loff_t header, int write)
+{
+    JOURNAL_HEAD head;
+    JOURNAL_REC *rec;
+    char *buf;
+    loff_t size, pos, at, len;
+    int n;
+
+    fs_read(header, sizeof(head), &head);
+    if (le32toh(head.magic) != JOURNAL_MAGIC)
+	return 0;
+    size = le32toh(head.size);
+    pos = le64toh(head.pos);
+    buf = NULL;
+    if (le32toh(head.sum) != journal_sum(&head, offsetof(JOURNAL_HEAD, sum))
+	|| size > JOURNAL_MAX)
+	goto damaged;
+    buf = talloc(size ? size : 1);
+    io_stats.syscalls++;
+    io_count(&io_stats, &io_next, pos, size, 0);
+    if (pread64(fd, buf, size, pos) != size ||
+	journal_sum(buf, size) != le32toh(head.data_sum))
+	goto damaged;
+    for (at = 0; at < size; at += len) {
+	rec = (JOURNAL_REC *) (buf + at);
+	if (size - at < (loff_t) sizeof(JOURNAL_REC))
+	    goto damaged;
+	len = sizeof(JOURNAL_REC) + (loff_t) le32toh(rec->size);
+	if (size - at < len)
+	    goto damaged;
+    }
+
+    /* Every record holds what was there before the flush, so the order they
+     * are put back in does not matter */
+    for (n = at = 0; at < size; at += len, n++) {
+	rec = (JOURNAL_REC *) (buf + at);
+	len = sizeof(JOURNAL_REC) + (loff_t) le32toh(rec->size);
+	if (!write) {
+	    fs_write(le64toh(rec->pos), le32toh(rec->size), rec + 1);
+	    continue;
+	}
+	if (map) {
+	    map_check(le64toh(rec->pos), le32toh(rec->size));
+	    memcpy(map + le64toh(rec->pos), rec + 1, le32toh(rec->size));
+	}
+	write_at(le64toh(rec->pos), le32toh(rec->size), rec + 1);
+    }
+    tfree(buf);
+    report("Rolled back an interrupted flush: restored %d range%s.\n", n,
+	   n == 1 ? "" : "s");
+    if (write) {
+	memset(&head, 0, sizeof(head));
+	if (fsync(fd) < 0 || !journal_mark(header, &head))
+	    pdie("Clearing the undo journal");
+	io_stats.syscalls++;
+	did_change = 1;
+    }
+    return 1;
+
+  damaged:
+    /* The header is only written around a flush, so it was interrupted and
+     * the volume may be anything between before and after it */
+    tfree(buf);
+    report("Undo journal is damaged, ignoring it.\n");
+    if (write) {
+	memset(&head, 0, sizeof(head));
+	if (!journal_mark(header, &head))
+	    pdie("Clearing the undo journal");
+	did_change = 1;
+    }
+    return 1;
+}
+
+/**
+ * Write all pending changes to disk. Changes are already sorted and merged;
+ * here neighbouring changes are further grouped into runs, followed by a
+ * single fsync. Changes to mirrored regions are then written again at each
+ * copy, after everything else is on disk, so the copies always end up
+ * matching their region.
+ */
 static void fs_flush(void)
 {
-    CHANGE *this;
-    int size;
+    FLUSH_RUN *runs;
+    JOURNAL_HEAD head;
+    int reqs, n_runs, i, journaled;
+    unsigned calls;
+
+    journaled = journal_begin();
+    runs = talloc((n_changes ? n_changes : 1) * sizeof(FLUSH_RUN));
+    calls = ioq_calls;
+    n_runs = 0;
+    reqs = flush_changes(runs, 0, n_changes, 0, &n_runs);
+    for (i = 0; i < n_mirrors; i++)
+	reqs += flush_changes(runs, change_first(mirrors[i].pos),
+			      change_first(mirrors[i].pos + mirrors[i].size),
+			      mirrors[i].copy - mirrors[i].pos, &n_runs);
+    tfree(runs);
 
-    while (changes) {
-	this = changes;
-	changes = changes->next;
-	if (llseek(fd, this->pos, 0) != this->pos)
-	    fprintf(stderr,
-		    "Seek to %lld failed: %s\n  Did not write %d bytes.\n",
-		    (long long)this->pos, strerror(errno), this->size);
-	else if ((size = write(fd, this->data, this->size)) < 0)
-	    fprintf(stderr, "Writing %d bytes at %lld failed: %s\n", this->size,
-		    (long long)this->pos, strerror(errno));
-	else if (size != this->size)
-	    fprintf(stderr, "Wrote %d bytes instead of %d bytes at %lld."
-		    "\n", size, this->size, (long long)this->pos);
-	free(this->data);
-	free(this);
+    if (n_changes) {
+	if (fsync(fd) < 0)
+	    fprintf(stderr, "Syncing filesystem failed: %s\n",
+		    strerror(errno));
+	io_stats.syscalls++;
+	reqs++;
     }
+    if (journaled) {
+	memset(&head, 0, sizeof(head));
+	if (!journal_mark(journal_head, &head))
+	    fprintf(stderr, "Clearing the undo journal failed: %s\n",
+		    strerror(errno));
+    }
+    calls = async_io ? ioq_calls - calls + !!n_changes : reqs;
+    if (verbose)
+	report("Flushed %d queued write%s (%d after merging) in %d run%s, "
+	       "%d I/O request%s, %u system call%s.\n", n_queued,
+	       n_queued == 1 ? "" : "s", n_changes, n_runs,
+	       n_runs == 1 ? "" : "s", reqs, reqs == 1 ? "" : "s", calls,
+	       calls == 1 ? "" : "s");
+}
+
+static void fs_discard(void)
+{
+    int i;
+
+    for (i = 0; i < n_changes; i++)
+	free(changes[i].data);
+    free(changes);
+    changes = NULL;
+    n_changes = max_changes = 0;
 }
 
 int fs_close(int write)
 {
-    CHANGE *next;
-    int changed;
+    int changed, closed;
 
-    changed = ! !changes;
+    changed = ! !n_changes;
+    prefetch_stop();
     if (write)
 	fs_flush();
-    else
-	while (changes) {
-	    next = changes->next;
-	    free(changes->data);
-	    free(changes);
-	    changes = next;
-	}
-    if (close(fd) < 0)
+    fs_discard();
+    cache_drop();
+    scan_close();
+    ioq_exit();
+    io_stats.syscalls += ioq_calls;
+    if (map) {
+	munmap(map, map_size);
+	map = NULL;
+    }
+    closed = close(fd);
+    fd = -1;
+    if (closed < 0)
 	pdie("closing filesystem");
     return changed || did_change;
 }
 
+void fs_abort(void)
+{
+    if (fd < 0)
+	return;
+    prefetch_stop();
+    fs_discard();
+    cache_drop();
+    scan_close();
+    ioq_exit();
+    if (map) {
+	munmap(map, map_size);
+	map = NULL;
+    }
+    close(fd);
+    fd = -1;
+}
+
 int fs_changed(void)
 {
-    return ! !changes || did_change;
+    return ! !n_changes || did_change;
 }
@@ -35,19 +35,87 @@ loff_t llseek(int fd, loff_t offset, int whence);
 
 void fs_open(char *path, int rw);
 
-/* Opens the filesystem PATH. If RW is zero, the filesystem is opened
-   read-only, otherwise, it is opened read-write. */
+/* Opens the filesystem PATH, which has to stay valid until fs_close. If RW
+   is zero, the filesystem is opened read-only, otherwise, it is opened
+   read-write. If mmap_io is set, the whole filesystem is mapped privately;
+   reads are then served from the mapping and changes are kept in it until
+   fs_close. Otherwise the worker threads used by fs_read_ahead are
+   started. */
 
 void fs_read(loff_t pos, int size, void *data);
 
 /* Reads SIZE bytes starting at POS into DATA. Performs all applicable
    changes. */
 
+typedef struct {
+    loff_t pos;
+    int size;
+    void *data;
+} FS_IO;
+
+void *fs_map(loff_t pos, int size);
+
+/* Returns a pointer to the SIZE bytes starting at POS, with all changes
+   applied, if the filesystem was opened with mmap_io and could be mapped.
+   Returns NULL otherwise; fs_read must be used then. The pointer is valid
+   until fs_close, and its contents follow later fs_write calls. */
+
+void fs_read_batch(FS_IO * io, int n);
+
+/* Performs N fs_read calls, described by IO, with all of them in flight at
+   the same time where the I/O backend allows it. */
+
+void fs_cache(loff_t pos, int size);
+
+/* Reads SIZE bytes starting at POS into a small LRU cache with a single
+   system call, so that subsequent fs_read calls inside that range are served
+   from memory. Pending changes are still applied by fs_read. */
+
+void fs_read_ahead(loff_t pos, int size);
+
+/* Hints that SIZE bytes starting at POS will be needed soon. With an
+   asynchronous backend, the range is read in the background; otherwise, if
+   scan_threads is set, it is read by a pool of that many worker threads.
+   Either way the data is picked up by a later fs_cache call for the same
+   range. */
+
+void fs_will_need(loff_t pos, int size);
+
+/* Like fs_read_ahead, but for data that is needed later: without worker
+   threads it only asks the kernel to start reading, so the few fs_cache
+   slots are left to data that is about to be used. */
+
+void fs_mirror(loff_t pos, loff_t size, loff_t copy);
+
+/* Registers COPY as a copy of the SIZE bytes starting at POS. Every later
+   fs_write inside that region is also made at the same offset in the copy,
+   but only recorded once; the copy is written when the changes are flushed.
+   Data written to the copy directly is overridden by data written to the
+   region. */
+
 int fs_test(loff_t pos, int size);
 
 /* Returns a non-zero integer if SIZE bytes starting at POS can be read without
    errors. Otherwise, it returns zero. */
 
+typedef struct {
+    loff_t pos;
+    loff_t size;
+} FS_EXTENT;
+
+void fs_scan(const FS_EXTENT * ext, int n, int unit,
+	     void (*bad) (loff_t pos, void *arg), void *arg);
+
+/* Tests that the N extents EXT can be read without errors, the way fs_test
+   does, but at the sequential speed of the device: they are read in large
+   requests, bypassing the page cache where the device allows it. Several
+   requests are kept in flight only if the I/O queue uses io_uring (see
+   ioqueue.h); otherwise they are made one after the other. Only a request
+   that fails is narrowed down, by bisection, to the UNIT sized pieces that
+   cannot be read; BAD is called with ARG and the position of each of those,
+   in the order of EXT. The size of every extent must be a multiple of
+   UNIT. */
+
 void fs_write(loff_t pos, int size, void *data);
 
 /* If write_immed is non-zero, SIZE bytes are written from DATA to the disk,
@@ -60,11 +128,60 @@ int fs_close(int write);
    and removes the list of changes. Returns a non-zero integer if the file
    system has been changed since the last fs_open, zero otherwise. */
 
+void fs_abort(void);
+
+/* Closes the filesystem after a failure, if it is open, dropping all pending
+   changes. */
+
 int fs_changed(void);
 
 /* Determines whether the filesystem has changed. See fs_close. */
 
-extern unsigned device_no;
+int fs_pending(loff_t pos, loff_t size);
+
+/* Returns a non-zero integer if flushing the pending changes writes to any
+   of the SIZE bytes starting at POS, counting the data around the changes
+   that fs_close rewrites to write whole blocks. */
+
+loff_t fs_undo_size(void);
+
+/* Returns the number of bytes of undo journal needed to flush the pending
+   changes, zero if there are none. */
+
+void fs_journal(loff_t header, loff_t pos, loff_t size);
+
+/* Has fs_close save the original contents of everything it is about to
+   overwrite in the SIZE bytes starting at POS before flushing the pending
+   changes, and record where they are in the 24 bytes at HEADER until the
+   flush is on disk. The journal must not be written by the flush, see
+   fs_pending. Without room for all of it, if the flush writes the block of
+   HEADER, or with write_immed, the changes are flushed without a journal. */
+
+int fs_replay(loff_t header, int write);
+
+/* Rolls back an interrupted flush if HEADER points to an undo journal,
+   writing the original contents back and clearing HEADER if WRITE is
+   non-zero, or only queueing them with fs_write otherwise. To be called
+   right after fs_open. Returns a non-zero integer if a flush was rolled
+   back, or if HEADER holds a damaged journal: that is left by an
+   interrupted flush too, which then cannot be rolled back, so the volume
+   must be checked fully. */
+
+typedef struct {
+    unsigned long long read_bytes, write_bytes;
+    unsigned long reads, writes;	/* requests */
+    unsigned long syscalls;
+    unsigned long seeks;	/* requests not continuing the previous one */
+    int peak_changes;		/* most changes pending at once */
+} IO_STATS;
+
+extern __thread IO_STATS io_stats;
+
+/* Counters of the I/O done since the last fs_open, complete once fs_close
+   returns. Reads served from the mapping with mmap_io are not included, as
+   they are not made by system calls. */
+
+extern __thread unsigned device_no;
 
 /* Major number of device (0 if file) and size (in 512 byte sectors) */
 
@@ -0,0 +1,304 @@
+/* ioqueue.c - Positional I/O requests kept in flight concurrently */
+
+#define _LARGEFILE64_SOURCE
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "ioqueue.h"
+
+#if defined(__NR_io_uring_setup) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define WITH_IO_URING
+#include <linux/io_uring.h>
+#endif
+#endif
+
+#define IOQ_DEPTH	32
+
+__thread unsigned ioq_calls;
+
+static __thread int ioq_fd = -1;
+
+/**
+ * Perform a request right away.
+ *
+ * @param[in,out] req   Request to perform
+ * @param[in]   fd      File to perform it on
+ */
+static void ioq_sync(IOQ_REQ * req, int fd)
+{
+    ssize_t r;
+
+    if (req->write)
+	r = pwritev64(fd, req->iov, req->iovcnt, req->pos);
+    else
+	r = preadv64(fd, req->iov, req->iovcnt, req->pos);
+    ioq_calls++;
+    req->res = r < 0 ? -errno : r;
+    req->done = 1;
+}
+
+#ifdef WITH_IO_URING
+
+/* The ring, as mapped from the kernel. Every request handed to it is kept
+ * in a slot until its completion is reaped; the index of the slot is the
+ * user_data of its submission entry. */
+static __thread struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    unsigned entries;
+    unsigned queued;		/* filled in SQ, not yet handed to the kernel */
+    unsigned inflight;		/* handed to the kernel, not yet reaped */
+    struct {
+	IOQ_REQ *req;		/* NULL if the slot is free */
+	int fd;
+    } slot[IOQ_DEPTH];
+} ring = {.fd = -1 };
+
+static int ring_enter(unsigned to_submit, unsigned min_complete)
+{
+    int r;
+
+    do {
+	r = syscall(__NR_io_uring_enter, ring.fd, to_submit, min_complete,
+		    min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (r < 0 && errno == EINTR);
+    ioq_calls++;
+    return r;
+}
+
+static int ring_setup(void)
+{
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    ring.fd = syscall(__NR_io_uring_setup, IOQ_DEPTH, &p);
+    if (ring.fd < 0)
+	return -1;
+
+    ring.entries = p.sq_entries < IOQ_DEPTH ? p.sq_entries : IOQ_DEPTH;
+    ring.sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring.cq_ring_size = p.cq_off.cqes +
+	p.cq_entries * sizeof(struct io_uring_cqe);
+    ring.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring.sq_ring = mmap(NULL, ring.sq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    ring.cq_ring = mmap(NULL, ring.cq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+    ring.sqes = mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE,
+		     MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+
+    if (ring.sq_ring == MAP_FAILED || ring.cq_ring == MAP_FAILED ||
+	ring.sqes == MAP_FAILED) {
+	if (ring.sq_ring != MAP_FAILED)
+	    munmap(ring.sq_ring, ring.sq_ring_size);
+	if (ring.cq_ring != MAP_FAILED)
+	    munmap(ring.cq_ring, ring.cq_ring_size);
+	if (ring.sqes != MAP_FAILED)
+	    munmap(ring.sqes, ring.sqes_size);
+	close(ring.fd);
+	ring.fd = -1;
+	return -1;
+    }
+
+    ring.sq_head = (unsigned *)((char *)ring.sq_ring + p.sq_off.head);
+    ring.sq_tail = (unsigned *)((char *)ring.sq_ring + p.sq_off.tail);
+    ring.sq_mask = (unsigned *)((char *)ring.sq_ring + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)((char *)ring.sq_ring + p.sq_off.array);
+    ring.cq_head = (unsigned *)((char *)ring.cq_ring + p.cq_off.head);
+    ring.cq_tail = (unsigned *)((char *)ring.cq_ring + p.cq_off.tail);
+    ring.cq_mask = (unsigned *)((char *)ring.cq_ring + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)((char *)ring.cq_ring + p.cq_off.cqes);
+    ring.queued = ring.inflight = 0;
+    memset(ring.slot, 0, sizeof(ring.slot));
+    return 0;
+}
+
+static void ring_teardown(void)
+{
+    munmap(ring.sq_ring, ring.sq_ring_size);
+    munmap(ring.cq_ring, ring.cq_ring_size);
+    munmap(ring.sqes, ring.sqes_size);
+    close(ring.fd);
+    ring.fd = -1;
+}
+
+/**
+ * Mark the requests whose completions the kernel has posted as done.
+ */
+static void ring_complete(void)
+{
+    struct io_uring_cqe *cqe;
+    unsigned head, tail;
+
+    head = *ring.cq_head;
+    tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+	cqe = &ring.cqes[head & *ring.cq_mask];
+	ring.slot[cqe->user_data].req->res = cqe->res;
+	ring.slot[cqe->user_data].req->done = 1;
+	ring.slot[cqe->user_data].req = NULL;
+	ring.inflight--;
+	head++;
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+/**
+ * Give up on the ring after the kernel refused to take or complete the
+ * requests. What it already took still completes into the ring without
+ * io_uring_enter(), and has to before anyone may reuse the buffers; the
+ * requests it never took are performed on the spot. Later requests are all
+ * performed synchronously.
+ */
+static void ring_fail(void)
+{
+    struct timespec tick = { 0, 1000000 };
+    int i;
+
+    for (ring_complete(); ring.inflight; ring_complete())
+	nanosleep(&tick, NULL);
+    ring_teardown();
+    for (i = 0; i < IOQ_DEPTH; i++)
+	if (ring.slot[i].req) {
+	    ioq_sync(ring.slot[i].req, ring.slot[i].fd);
+	    ring.slot[i].req = NULL;
+	}
+    ring.queued = 0;
+}
+
+/**
+ * Hand the queued requests to the kernel and collect completions.
+ *
+ * @param[in]   wait    Block until at least one request has completed
+ *
+ * @return      -1 if the ring had to be given up, see ring_fail()
+ */
+static int ring_reap(int wait)
+{
+    int r;
+
+    if (ring.queued || wait) {
+	r = ring_enter(ring.queued, wait);
+	if (r < 0 && errno != EBUSY && errno != EAGAIN) {
+	    ring_fail();
+	    return -1;
+	}
+	if (r > 0) {
+	    ring.inflight += r;
+	    ring.queued -= r;
+	}
+    }
+    ring_complete();
+    return 0;
+}
+
+/**
+ * Queue a request in the ring.
+ *
+ * @return      -1 if the ring had to be given up, see ring_fail()
+ */
+static int ring_submit(IOQ_REQ * req, int fd)
+{
+    struct io_uring_sqe *sqe;
+    unsigned tail, idx;
+    int i;
+
+    while (ring.queued + ring.inflight >= ring.entries)
+	if (ring_reap(1))
+	    return -1;
+    for (i = 0; ring.slot[i].req; i++) ;
+    ring.slot[i].req = req;
+    ring.slot[i].fd = fd;
+
+    tail = *ring.sq_tail;
+    idx = tail & *ring.sq_mask;
+    sqe = &ring.sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = req->write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->off = req->pos;
+    sqe->addr = (uintptr_t) req->iov;
+    sqe->len = req->iovcnt;
+    sqe->user_data = i;
+    ring.sq_array[idx] = idx;
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring.queued++;
+    return 0;
+}
+
+#endif
+
+int ioq_init(int fd)
+{
+    ioq_fd = fd;
+    ioq_calls = 0;
+#ifdef WITH_IO_URING
+    if (!ring_setup())
+	return 1;
+#endif
+    return 0;
+}
+
+void ioq_exit(void)
+{
+#ifdef WITH_IO_URING
+    /* If the ring is given up, ring_fail() finishes every request itself */
+    while (ring.fd != -1 && (ring.queued || ring.inflight))
+	ring_reap(1);
+    if (ring.fd != -1)
+	ring_teardown();
+#endif
+    ioq_fd = -1;
+}
+
+void ioq_submit(IOQ_REQ * req)
+{
+    ioq_submit_fd(req, ioq_fd);
+}
+
+void ioq_submit_fd(IOQ_REQ * req, int fd)
+{
+    req->done = 0;
+    req->res = 0;
+#ifdef WITH_IO_URING
+    if (ring.fd != -1 && !ring_submit(req, fd))
+	return;
+#endif
+    ioq_sync(req, fd);
+}
+
+void ioq_wait(IOQ_REQ * req)
+{
+#ifdef WITH_IO_URING
+    if (ring.fd != -1 && !req->done)
+	ring_reap(0);
+    while (ring.fd != -1 && !req->done)
+	ring_reap(1);
+#endif
+    if (!req->done)
+	ioq_sync(req, ioq_fd);
+}
+
+void ioq_run(IOQ_REQ * reqs, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+	ioq_submit(&reqs[i]);
+    for (i = 0; i < n; i++)
+	ioq_wait(&reqs[i]);
+}
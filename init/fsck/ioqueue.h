@@ -0,0 +1,55 @@
+/* ioqueue.h - Positional I/O requests kept in flight concurrently
+
+   With io_uring (when both the kernel headers this is built against and the
+   running kernel support it) requests are queued to the kernel and complete
+   asynchronously. Otherwise ioq_submit performs the request on the spot with
+   preadv/pwritev, so callers never need to care which backend is used. */
+
+#ifndef _IOQUEUE_H
+#define _IOQUEUE_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+
+typedef struct ioq_req {
+    loff_t pos;
+    struct iovec *iov;
+    int iovcnt;
+    int write;
+    ssize_t res;		/* bytes transferred or -errno, once done */
+    int done;
+} IOQ_REQ;
+
+int ioq_init(int fd);
+
+/* Sets up the queue for FD. Returns non-zero if requests can actually be
+   kept in flight (io_uring), zero if they are performed synchronously. */
+
+void ioq_exit(void);
+
+/* Waits for all requests in flight and tears down the queue. */
+
+void ioq_submit(IOQ_REQ * req);
+
+/* Starts REQ. REQ and its buffers must stay valid until it is done. */
+
+void ioq_submit_fd(IOQ_REQ * req, int fd);
+
+/* Like ioq_submit, but for FD instead of the file the queue was set up
+   for. */
+
+void ioq_wait(IOQ_REQ * req);
+
+/* Waits until REQ is done. Once it is, the kernel no longer accesses REQ or
+   its buffers. */
+
+void ioq_run(IOQ_REQ * reqs, int n);
+
+/* Submits N requests and waits for all of them. */
+
+extern __thread unsigned ioq_calls;
+
+/* Number of I/O system calls issued by the queue. */
+
+#endif
@@ -49,11 +49,11 @@ typedef struct {
 #define CHARS_PER_LFN	13
 
 /* These modul-global vars represent the state of the LFN parser */
-unsigned char *lfn_unicode = NULL;
-unsigned char lfn_checksum;
-int lfn_slot = -1;
-loff_t *lfn_offsets = NULL;
-int lfn_parts = 0;
+__thread unsigned char *lfn_unicode = NULL;
+__thread unsigned char lfn_checksum;
+__thread int lfn_slot = -1;
+__thread loff_t *lfn_offsets = NULL;
+__thread int lfn_parts = 0;
 
 static unsigned char fat_uni2esc[64] = {
     '0', '1', '2', '3', '4', '5', '6', '7',
@@ -218,22 +218,22 @@ void lfn_add_slot(DIR_ENT * de, loff_t dir_offset)
 	     *        checksum ok: clear start bit */
 	    /* XXX: Should delay that until next LFN known (then can better
 	     * display the name) */
-	    printf("A new long file name starts within an old one.\n");
+	    report("A new long file name starts within an old one.\n");
 	    if (slot == lfn_slot && lfn->alias_checksum == lfn_checksum) {
 		char *part1 = CNV_THIS_PART(lfn);
 		char *part2 = CNV_PARTS_SO_FAR();
-		printf("  It could be that the LFN start bit is wrong here\n"
+		report("  It could be that the LFN start bit is wrong here\n"
 		       "  if \"%s\" seems to match \"%s\".\n", part1, part2);
 		free(part1);
 		free(part2);
 		can_clear = 1;
 	    }
 	    if (interactive) {
-		printf("1: Delete previous LFN\n2: Leave it as it is.\n");
+		report("1: Delete previous LFN\n2: Leave it as it is.\n");
 		if (can_clear)
-		    printf("3: Clear start bit and concatenate LFNs\n");
+		    report("3: Clear start bit and concatenate LFNs\n");
 	    } else
-		printf("  Not auto-correcting this.\n");
+		report("  Not auto-correcting this.\n");
 	    if (interactive) {
 		switch (get_key(can_clear ? "123" : "12", "?")) {
 		case '1':
@@ -261,14 +261,14 @@ void lfn_add_slot(DIR_ENT * de, loff_t dir_offset)
 	 *         lost */
 	/* Fixes: 1) delete LFN, 2) set start bit */
 	char *part = CNV_THIS_PART(lfn);
-	printf("Long filename fragment \"%s\" found outside a LFN "
+	report("Long filename fragment \"%s\" found outside a LFN "
 	       "sequence.\n  (Maybe the start bit is missing on the "
 	       "last fragment)\n", part);
 	if (interactive) {
-	    printf("1: Delete fragment\n2: Leave it as it is.\n"
+	    report("1: Delete fragment\n2: Leave it as it is.\n"
 		   "3: Set start bit\n");
 	} else
-	    printf("  Not auto-correcting this.\n");
+	    report("  Not auto-correcting this.\n");
 	switch (interactive ? get_key("123", "?") : '2') {
 	case '1':
 	    if (!lfn_offsets)
@@ -298,24 +298,24 @@ void lfn_add_slot(DIR_ENT * de, loff_t dir_offset)
 	 *        are ok?, maybe only if checksum is ok?) (Attention: space
 	 *        for name was allocated before!) */
 	int can_fix = 0;
-	printf("Unexpected long filename sequence number "
+	report("Unexpected long filename sequence number "
 	       "(%d vs. expected %d).\n", slot, lfn_slot);
 	if (lfn->alias_checksum == lfn_checksum && lfn_slot > 0) {
 	    char *part1 = CNV_THIS_PART(lfn);
 	    char *part2 = CNV_PARTS_SO_FAR();
-	    printf("  It could be that just the number is wrong\n"
+	    report("  It could be that just the number is wrong\n"
 		   "  if \"%s\" seems to match \"%s\".\n", part1, part2);
 	    free(part1);
 	    free(part2);
 	    can_fix = 1;
 	}
 	if (interactive) {
-	    printf
+	    report
 		("1: Delete LFN\n2: Leave it as it is (and ignore LFN so far)\n");
 	    if (can_fix)
-		printf("3: Correct sequence number\n");
+		report("3: Correct sequence number\n");
 	} else
-	    printf("  Not auto-correcting this.\n");
+	    report("  Not auto-correcting this.\n");
 	switch (interactive ? get_key(can_fix ? "123" : "12", "?") : '2') {
 	case '1':
 	    if (!lfn_offsets) {
@@ -341,14 +341,14 @@ void lfn_add_slot(DIR_ENT * de, loff_t dir_offset)
 	/* checksum mismatch */
 	/* Causes: 1) checksum field here destroyed */
 	/* Fixes: 1) delete LFN, 2) fix checksum */
-	printf("Checksum in long filename part wrong "
+	report("Checksum in long filename part wrong "
 	       "(%02x vs. expected %02x).\n",
 	       lfn->alias_checksum, lfn_checksum);
 	if (interactive) {
-	    printf("1: Delete LFN\n2: Leave it as it is.\n"
+	    report("1: Delete LFN\n2: Leave it as it is.\n"
 		   "3: Correct checksum\n");
 	} else
-	    printf("  Not auto-correcting this.\n");
+	    report("  Not auto-correcting this.\n");
 	if (interactive) {
 	    switch (get_key("123", "?")) {
 	    case '1':
@@ -377,12 +377,12 @@ void lfn_add_slot(DIR_ENT * de, loff_t dir_offset)
     }
 
     if (lfn->reserved != 0) {
-	printf("Reserved field in VFAT long filename slot is not 0 "
+	report("Reserved field in VFAT long filename slot is not 0 "
 	       "(but 0x%02x).\n", lfn->reserved);
 	if (interactive)
-	    printf("1: Fix.\n2: Leave it.\n");
+	    report("1: Fix.\n2: Leave it.\n");
 	else
-	    printf("Auto-setting to 0.\n");
+	    report("Auto-setting to 0.\n");
 	if (!interactive || get_key("12", "?") == '1') {
 	    lfn->reserved = 0;
 	    fs_write(dir_offset + offsetof(LFN_ENT, reserved),
@@ -390,12 +390,12 @@ void lfn_add_slot(DIR_ENT * de, loff_t dir_offset)
 	}
     }
     if (lfn->start != htole16(0)) {
-	printf("Start cluster field in VFAT long filename slot is not 0 "
+	report("Start cluster field in VFAT long filename slot is not 0 "
 	       "(but 0x%04x).\n", lfn->start);
 	if (interactive)
-	    printf("1: Fix.\n2: Leave it.\n");
+	    report("1: Fix.\n2: Leave it.\n");
 	else
-	    printf("Auto-setting to 0.\n");
+	    report("Auto-setting to 0.\n");
 	if (!interactive || get_key("12", "?") == '1') {
 	    lfn->start = htole16(0);
 	    fs_write(dir_offset + offsetof(LFN_ENT, start),
@@ -418,7 +418,7 @@ char *lfn_get(DIR_ENT * de, loff_t * lfn_offset)
 
 #if 0
     if (de->lcase)
-	printf("lcase=%02x\n", de->lcase);
+	report("lcase=%02x\n", de->lcase);
 #endif
 
     if (lfn_slot == -1)
@@ -433,16 +433,16 @@ char *lfn_get(DIR_ENT * de, loff_t * lfn_offset)
 	 * 3) renumber entries and truncate name */
 	char *long_name = CNV_PARTS_SO_FAR();
 	char *short_name = file_name(de->name);
-	printf("Unfinished long file name \"%s\".\n"
+	report("Unfinished long file name \"%s\".\n"
 	       "  (Start may have been overwritten by %s)\n",
 	       long_name, short_name);
 	free(long_name);
 	if (interactive) {
-	    printf("1: Delete LFN\n2: Leave it as it is.\n"
+	    report("1: Delete LFN\n2: Leave it as it is.\n"
 		   "3: Fix numbering (truncates long name and attaches "
 		   "it to short name %s)\n", short_name);
 	} else
-	    printf("  Not auto-correcting this.\n");
+	    report("  Not auto-correcting this.\n");
 	switch (interactive ? get_key("123", "?") : '2') {
 	case '1':
 	    clear_lfn_slots(0, lfn_parts - 1);
@@ -473,15 +473,15 @@ char *lfn_get(DIR_ENT * de, loff_t * lfn_offset)
 	/* Fixes: 1) Fix checksum in LFN entries */
 	char *long_name = CNV_PARTS_SO_FAR();
 	char *short_name = file_name(de->name);
-	printf("Wrong checksum for long file name \"%s\".\n"
+	report("Wrong checksum for long file name \"%s\".\n"
 	       "  (Short name %s may have changed without updating the long name)\n",
 	       long_name, short_name);
 	free(long_name);
 	if (interactive) {
-	    printf("1: Delete LFN\n2: Leave it as it is.\n"
+	    report("1: Delete LFN\n2: Leave it as it is.\n"
 		   "3: Fix checksum (attaches to short name %s)\n", short_name);
 	} else
-	    printf("  Not auto-correcting this.\n");
+	    report("  Not auto-correcting this.\n");
 	if (interactive) {
 	    switch (get_key("123", "?")) {
 	    case '1':
@@ -507,6 +507,38 @@ char *lfn_get(DIR_ENT * de, loff_t * lfn_offset)
     return (lfn);
 }
 
+char *lfn_read(loff_t offset, loff_t bound, loff_t * lfn_offset)
+{
+    unsigned char uni[(LFN_ID_SLOTMASK * CHARS_PER_LFN + 1) * 2];
+    unsigned char sum;
+    DIR_ENT de;
+    LFN_ENT lfn;
+    int i, n;
+
+    fs_read(offset, sizeof(de), &de);
+    for (sum = 0, i = 0; i < 8; i++)
+	sum = (((sum & 1) << 7) | ((sum & 0xfe) >> 1)) + de.name[i];
+    for (i = 0; i < 3; i++)
+	sum = (((sum & 1) << 7) | ((sum & 0xfe) >> 1)) + de.ext[i];
+
+    /* The slot right before the entry holds the first part of the name,
+     * the one marked with LFN_ID_START the last */
+    memset(uni, 0, sizeof(uni));
+    for (n = 0; n < LFN_ID_SLOTMASK && offset > bound; n++) {
+	offset -= sizeof(LFN_ENT);
+	fs_read(offset, sizeof(lfn), &lfn);
+	if (lfn.attr != VFAT_LN_ATTR || lfn.id == DELETED_FLAG ||
+	    (lfn.id & LFN_ID_SLOTMASK) != n + 1 || lfn.alias_checksum != sum)
+	    return NULL;
+	copy_lfn_part(uni + n * CHARS_PER_LFN * 2, &lfn);
+	if (lfn.id & LFN_ID_START) {
+	    *lfn_offset = offset;
+	    return cnv_unicode(uni, UNTIL_0, 0);
+	}
+    }
+    return NULL;
+}
+
 void lfn_check_orphaned(void)
 {
     char *long_name;
@@ -515,11 +547,11 @@ void lfn_check_orphaned(void)
 	return;
 
     long_name = CNV_PARTS_SO_FAR();
-    printf("Orphaned long file name part \"%s\"\n", long_name);
+    report("Orphaned long file name part \"%s\"\n", long_name);
     if (interactive)
-	printf("1: Delete.\n2: Leave it.\n");
+	report("1: Delete.\n2: Leave it.\n");
     else
-	printf("  Auto-deleting.\n");
+	report("  Auto-deleting.\n");
     if (!interactive || get_key("12", "?") == '1') {
 	clear_lfn_slots(0, lfn_parts - 1);
     }
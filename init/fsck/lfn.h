@@ -32,6 +32,12 @@ void lfn_add_slot(DIR_ENT * de, loff_t dir_offset);
 char *lfn_get(DIR_ENT * de, loff_t * lfn_offset);
 /* Retrieve the long name for the proper dir entry. */
 
+char *lfn_read(loff_t offset, loff_t bound, loff_t * lfn_offset);
+/* Read the long name of the dir entry at OFFSET from the slots before it on
+   disk, back to BOUND at most, without touching the state of the parser.
+   Returns NULL if there is no complete long name for the entry, otherwise
+   the name, allocated with alloc(), and its first slot in *LFN_OFFSET. */
+
 void lfn_check_orphaned(void);
 
 void lfn_fix_checksum(loff_t from, loff_t to, const char *short_name);
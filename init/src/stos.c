@@ -5,20 +5,26 @@
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <fcntl.h>
 
 #include <sys/mount.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/utsname.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 
 #include "util.h"
 #include "logging.h"
 #include "main.h"
+#include "../fsck/fsck.h"
 
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
 static int factory_reset;
+static int verify_boot_partition;
+static fsck_ctx_t boot_check;
 static pthread_t movian_shell;
 
 /**
@@ -56,9 +62,75 @@ status(const char *fmt, ...)
 
 
 
+/**
+ *
+ */
+static void
+log_fsck(const char *line)
+{
+  trace(LOG_INFO, "fsck: %s", line);
+}
+
+
+/**
+ * Log the stats of the last check and keep them in 'path' for tools
+ * that track boot time across the fleet
+ */
+static void
+save_fsck_stats(const fsck_ctx_t *ctx, const char *path)
+{
+  const char *stats = ctx->stats;
+  int len = strlen(stats);
+
+  trace(LOG_INFO, "fsck stats: %s", stats);
+
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if(fd == -1) {
+    trace(LOG_ERR, "Unable to open %s -- %s", path, strerror(errno));
+    return;
+  }
+  if(write(fd, stats, len) != len || write(fd, "\n", 1) != 1)
+    trace(LOG_ERR, "Failed to write to %s -- %s", path, strerror(errno));
+  close(fd);
+}
+
+
+/**
+ *
+ */
+static void *
+verify_boot(void *aux)
+{
+  setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+
+  fsck_ctx_t ctx;
+  fsck_init(&ctx, "/dev/mmcblk0p1");
+  // Stay out of the way of Movian reading from the card, with a single
+  // thread and little memory
+  ctx.stream_scan = 1;
+  // Nothing is written, so the FATs can be used straight out of the page
+  // cache instead of being read into two copies of our own
+  ctx.mmap_io = 1;
+  ctx.collect_report = 1;
+  int r = fsck_verify(&ctx);
+  fsck_report(&ctx, log_fsck);
+  save_fsck_stats(&ctx, "/run/fsck-verify.stats");
+  if(r == FSCK_ERROR)
+    trace(LOG_ERR, "Unable to verify boot partition -- %s", ctx.error);
+  else if(r)
+    trace(LOG_ERR, "Boot partition needs repair, will be fixed on next boot");
+  else
+    trace(LOG_INFO, "Boot partition verified");
+  return NULL;
+}
+
+
 #define STOS_BASE "/stos"
 
 #define PERSISTENTPATH STOS_BASE"/persistent"
+
+// Number of boots since the boot partition was last checked in full
+#define FSCK_SKIPPED_PATH PERSISTENTPATH"/fsck-skipped"
 #define CACHEPATH      STOS_BASE"/cache"
 #define MNTPATH        STOS_BASE"/mnt"
 #define MOVIANMOUNTPATH MNTPATH"/showtime"
@@ -436,6 +508,34 @@ setup_partitions(void)
 
 
 
+/**
+ * Count one more boot on which the full check of the boot partition was
+ * skipped, and return how many there have been in a row
+ */
+static int
+count_skipped_check(void)
+{
+  int skipped = 0;
+  FILE *fp = fopen(FSCK_SKIPPED_PATH, "r");
+  if(fp != NULL) {
+    if(fscanf(fp, "%d", &skipped) != 1)
+      skipped = 0;
+    fclose(fp);
+  }
+  skipped++;
+
+  fp = fopen(FSCK_SKIPPED_PATH, "w");
+  if(fp == NULL) {
+    trace(LOG_ERR, "Unable to open %s -- %s",
+          FSCK_SKIPPED_PATH, strerror(errno));
+    return skipped;
+  }
+  fprintf(fp, "%d\n", skipped);
+  fclose(fp);
+  return skipped;
+}
+
+
 /**
  *
  */
@@ -450,6 +550,8 @@ bootuserland(void *aux)
   task_run("/usr/sbin/stos-splash -s Booting... -f /usr/share/fonts/Audiowide-Regular.ttf", TASK_F_BACKGROUND);
 
   trace(LOG_INFO, "Booting userland");
+  fsck_report(&boot_check, log_fsck);
+  save_fsck_stats(&boot_check, "/run/fsck.stats");
 
   mkdir("/tmp/stos", 0755);
   mkdir("/tmp/stos/mnt", 0755);
@@ -464,6 +566,16 @@ bootuserland(void *aux)
   mount_or_panic(cache_part, CACHEPATH,
                  "ext4",  MS_NOATIME | MS_NOSUID | MS_NODEV, "");
 
+  // The boot check leaves the card alone when it skips the tree, so the
+  // skipped checks are counted here, and every tenth boot the tree is
+  // walked in the background instead
+  if(!boot_check.skipped) {
+    unlink(FSCK_SKIPPED_PATH);
+  } else if(count_skipped_check() >= 10) {
+    unlink(FSCK_SKIPPED_PATH);
+    verify_boot_partition = 1;
+  }
+
   mkdir("/var/run/dbus", 0755);
   mkdir("/var/lock/subsys", 0755);
   mkdir("/tmp/dbus", 0755);
@@ -487,6 +599,9 @@ bootuserland(void *aux)
   run_detached_thread(start_sshd, NULL);
 
   pthread_create(&movian_shell, NULL, start_movian, NULL);
+
+  if(verify_boot_partition)
+    run_detached_thread(verify_boot, NULL);
   return NULL;
 }
 
@@ -547,8 +662,29 @@ step_mount_root(void)
   parse_partition_table();
   unmount("/proc");
 
-  extern void fsck(const char *path);
-  fsck("/dev/mmcblk0p1");
+  fsck_init(&boot_check, "/dev/mmcblk0p1");
+  // Keep a read queued at the SD controller while the last one is parsed;
+  // it serves one at a time, so more threads would only wait on it
+  boot_check.scan_threads = 2;
+  // We run from initramfs; don't keep the whole directory tree in RAM
+  boot_check.stream_scan = 1;
+  // Only walk the whole tree when the volume changed behind our back, see
+  // bootuserland() for the periodic full check
+  boot_check.fast_check = 1;
+  // Don't let the number of files on the card decide how long we boot,
+  // whatever is left unchecked is verified once userland is up
+  boot_check.check_budget = 1500;
+  // The console is a 115200 baud serial line, keep the details for syslog
+  boot_check.collect_report = 1;
+  switch(fsck_run(&boot_check)) {
+  case FSCK_INCOMPLETE:
+    verify_boot_partition = 1;
+    break;
+  case FSCK_ERROR:
+    // Try to boot anyway, the mount below tells if that is hopeless
+    printf("Unable to check boot partition -- %s\n", boot_check.error);
+    break;
+  }
 
   mount_or_panic("/dev/mmcblk0p1", "/boot", "vfat", MS_RDONLY, "");
 